@@ -1,5 +1,6 @@
 #include <iostream>
 #include <string>
+#include <list>
 #include <vector>
 #include <map>
 
@@ -239,6 +240,47 @@ Register getRegParameter(string regname, vector<int> &idx)
      }
 }
 
+// parse a location given by the user into byte parameters. A location is a
+// register name (eax, ax, al, ...) or a hex memory address with an optional
+// byte length, e.g. 0x12ff40:4. Return 0 on success.
+int parseLocation(string s, vector<Parameter> *v)
+{
+     if (s.compare(0, 2, "0x") == 0) {
+          size_t colon = s.find(':');
+          ADDR32 addr, len = 1;
+          try {
+               addr = stoul(s.substr(0, colon), 0, 16);
+               if (colon != string::npos)
+                    len = stoul(s.substr(colon + 1), 0, 0);
+          } catch (...) {
+               return 1;
+          }
+          for (ADDR32 i = 0; i < len; ++i) {
+               Parameter p;
+               p.ty = Parameter::MEM;
+               p.idx = addr + i;
+               v->push_back(p);
+          }
+          return 0;
+     }
+
+     if (!isReg32(s) && !isReg16(s) && !isReg8(s))
+          return 1;
+
+     vector<int> idx;
+     Register r = getRegParameter(s, idx);
+     if (r == UNK)
+          return 1;
+     for (int i = 0, max = idx.size(); i < max; ++i) {
+          Parameter p;
+          p.ty = Parameter::REG;
+          p.reg = r;
+          p.idx = idx[i];
+          v->push_back(p);
+     }
+     return 0;
+}
+
 void Inst::addsrc(Parameter::Type t, string s)
 {
      if (t == Parameter::IMM) {
@@ -356,3 +398,220 @@ void Inst::adddst2(Parameter::Type t, AddrRange a)
           dst2.push_back(p);
      }
 }
+
+// parse an instruction id range first-last given by the user, e.g. a
+// snippet of vmsnippets.txt. Return 0 on success.
+int parseRange(string s, int *first, int *last)
+{
+     size_t dash = s.find('-');
+     if (dash == string::npos)
+          return 1;
+     try {
+          *first = stoi(s.substr(0, dash));
+          *last = stoi(s.substr(dash + 1));
+     } catch (...) {
+          return 1;
+     }
+     return (*first < 1 || *first > *last) ? 1 : 0;
+}
+
+// append v to buf as an unsigned LEB128 varint
+void putVarint(vector<uint8_t> *buf, uint64_t v)
+{
+     while (v >= 0x80) {
+          buf->push_back((uint8_t)(v | 0x80));
+          v >>= 7;
+     }
+     buf->push_back((uint8_t)v);
+}
+
+// decode one varint at p into v, return the position after it
+const uint8_t *getVarint(const uint8_t *p, uint64_t *v)
+{
+     uint64_t res = 0;
+     int shift = 0;
+     while (*p & 0x80) {
+          res |= (uint64_t)(*p++ & 0x7f) << shift;
+          shift += 7;
+     }
+     *v = res | ((uint64_t)*p++ << shift);
+     return p;
+}
+
+// FNV-1a hash of the static instruction sequence [begin, end): the address
+// and opcode of every instruction, so instances of the same code path hash
+// the same whatever their register and memory values
+uint64_t hashInstSeq(list<Inst>::iterator begin, list<Inst>::iterator end)
+{
+     uint64_t h = 0xcbf29ce484222325ULL;
+     const uint64_t prime = 0x100000001b3ULL;
+
+     for (list<Inst>::iterator it = begin; it != end; ++it) {
+          for (int i = 0; i < 4; ++i) {
+               h = (h ^ ((it->addrn >> (i * 8)) & 0xff)) * prime;
+          }
+          for (int i = 0, max = it->opcstr.size(); i < max; ++i) {
+               h = (h ^ (uint8_t)it->opcstr[i]) * prime;
+          }
+          h = (h ^ 0xff) * prime;     // separates the opcodes
+     }
+
+     return h;
+}
+
+// whether [b1, e1) and [b2, e2) are the same static instruction sequence,
+// comparing what hashInstSeq hashes
+bool sameInstSeq(list<Inst>::iterator b1, list<Inst>::iterator e1,
+                 list<Inst>::iterator b2, list<Inst>::iterator e2)
+{
+     for (; b1 != e1 && b2 != e2; ++b1, ++b2) {
+          if (b1->addrn != b2->addrn || b1->opcstr != b2->opcstr)
+               return false;
+     }
+     return b1 == e1 && b2 == e2;
+}
+
+// Find the period p <= maxp whose repetitions cover the most of seq from
+// pos on, with at least two repetitions. Return p and the number of whole
+// repetitions in *reps, or 0 if seq does not repeat at pos.
+int findPeriod(const vector<int> &seq, size_t pos, int maxp, int *reps)
+{
+     int best = 0;
+     size_t bestlen = 0;
+     size_t n = seq.size();
+
+     for (int p = 1; p <= maxp && pos + 2 * p <= n; ++p) {
+          size_t j = pos + p;
+          while (j < n && seq[j] == seq[j - p])
+               ++j;
+          size_t len = (j - pos) / p * p;
+          if (len >= 2 * (size_t)p && len > bestlen) {
+               best = p;
+               bestlen = len;
+          }
+     }
+
+     *reps = best == 0 ? 0 : bestlen / best;
+     return best;
+}
+
+// ********************************
+//  Class ShadowState Implementation
+// ********************************
+
+ShadowState::ShadowState() : pages(1 << (32 - PAGEBITS), NULL), nlive(0)
+{
+     regs[0] = regs[1] = 0;
+}
+
+ShadowState::~ShadowState()
+{
+     for (int i = 0, max = pages.size(); i < max; ++i) {
+          delete[] pages[i];
+     }
+}
+
+bool ShadowState::test(const Parameter &p) const
+{
+     if (p.ty == Parameter::REG) {
+          unsigned int lane = p.reg * 4 + p.idx;
+          return (regs[lane >> 6] >> (lane & 63)) & 1;
+     } else if (p.ty == Parameter::MEM) {
+          uint64_t *page = pages[p.idx >> PAGEBITS];
+          if (page == NULL)
+               return false;
+          ADDR32 off = p.idx & ((1 << PAGEBITS) - 1);
+          return (page[off >> 6] >> (off & 63)) & 1;
+     } else {
+          return false;
+     }
+}
+
+void ShadowState::set(const Parameter &p)
+{
+     uint64_t *word;
+     uint64_t bit;
+
+     if (p.ty == Parameter::REG) {
+          unsigned int lane = p.reg * 4 + p.idx;
+          word = &regs[lane >> 6];
+          bit = (uint64_t)1 << (lane & 63);
+     } else if (p.ty == Parameter::MEM) {
+          uint64_t *&page = pages[p.idx >> PAGEBITS];
+          if (page == NULL)
+               page = new uint64_t[PAGEWORDS]();
+          ADDR32 off = p.idx & ((1 << PAGEBITS) - 1);
+          word = &page[off >> 6];
+          bit = (uint64_t)1 << (off & 63);
+     } else {
+          return;               // IMM is never live
+     }
+
+     if (!(*word & bit)) {
+          *word |= bit;
+          ++nlive;
+     }
+}
+
+void ShadowState::reset(const Parameter &p)
+{
+     uint64_t *word;
+     uint64_t bit;
+
+     if (p.ty == Parameter::REG) {
+          unsigned int lane = p.reg * 4 + p.idx;
+          word = &regs[lane >> 6];
+          bit = (uint64_t)1 << (lane & 63);
+     } else if (p.ty == Parameter::MEM) {
+          uint64_t *page = pages[p.idx >> PAGEBITS];
+          if (page == NULL)
+               return;
+          ADDR32 off = p.idx & ((1 << PAGEBITS) - 1);
+          word = &page[off >> 6];
+          bit = (uint64_t)1 << (off & 63);
+     } else {
+          return;
+     }
+
+     if (*word & bit) {
+          *word &= ~bit;
+          --nlive;
+     }
+}
+
+void ShadowState::clear()
+{
+     regs[0] = regs[1] = 0;
+     for (int i = 0, max = pages.size(); i < max; ++i) {
+          delete[] pages[i];
+          pages[i] = NULL;
+     }
+     nlive = 0;
+}
+
+// show all live parameters in the same order as a set<Parameter>
+void ShadowState::show() const
+{
+     Parameter p;
+
+     p.ty = Parameter::REG;
+     for (unsigned int lane = 0; lane < (UNK + 1) * 4; ++lane) {
+          if ((regs[lane >> 6] >> (lane & 63)) & 1) {
+               p.reg = (Register)(lane / 4);
+               p.idx = lane % 4;
+               p.show();
+          }
+     }
+
+     p.ty = Parameter::MEM;
+     for (int i = 0, max = pages.size(); i < max; ++i) {
+          uint64_t *page = pages[i];
+          if (page == NULL) continue;
+          for (int w = 0; w < PAGEWORDS; ++w) {
+               for (uint64_t bits = page[w]; bits != 0; bits &= bits - 1) {
+                    p.idx = ((ADDR32)i << PAGEBITS) + w * 64 + __builtin_ctzll(bits);
+                    p.show();
+               }
+          }
+     }
+}
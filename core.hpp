@@ -76,4 +76,80 @@ struct Inst {
 
 typedef pair< map<int,int>, map<int,int> > FullMap;
 
+// ShadowState is a dense set of REG and MEM Parameters used as the live set in
+// slicing. Every register byte is one bit in a lane mask (reg * 4 + idx), and
+// every memory byte is one bit in a two-level page table over the 32 bit
+// address space. Pages are allocated when a byte in them is first set.
+class ShadowState {
+     static const int PAGEBITS = 16;                   // address bits per page
+     static const int PAGEWORDS = (1 << PAGEBITS) / 64;
+
+     uint64_t regs[2];          // register lanes, (UNK + 1) * 4 bits
+     vector<uint64_t *> pages;  // top level table indexed by addr >> PAGEBITS
+     long nlive;                // number of live bytes
+
+public:
+     ShadowState();
+     ~ShadowState();
+     ShadowState(const ShadowState &) = delete;
+     ShadowState &operator=(const ShadowState &) = delete;
+
+     bool test(const Parameter &p) const;
+     void set(const Parameter &p);
+     void reset(const Parameter &p);
+     bool empty() const { return nlive == 0; }
+     void clear();
+     void show() const;
+};
+
+// ShadowMap keeps one value of type T for every register byte and memory byte,
+// with the same register lanes as ShadowState. Its pages cover 4 KB of memory
+// rather than 64 KB, since they hold a T per byte instead of a bit. Bytes
+// never written read as T().
+template <typename T>
+class ShadowMap {
+     static const int PAGEBITS = 12;
+     static const int PAGESIZE = 1 << PAGEBITS;
+
+     T regs[(UNK + 1) * 4];
+     vector<T *> pages;
+
+public:
+     ShadowMap() : regs(), pages(1 << (32 - PAGEBITS), NULL) {}
+     ~ShadowMap() {
+          for (int i = 0, max = pages.size(); i < max; ++i)
+               delete[] pages[i];
+     }
+     ShadowMap(const ShadowMap &) = delete;
+     ShadowMap &operator=(const ShadowMap &) = delete;
+
+     // value of a REG or MEM parameter
+     T get(const Parameter &p) const {
+          if (p.ty == Parameter::REG)
+               return regs[p.reg * 4 + p.idx];
+          T *page = pages[p.idx >> PAGEBITS];
+          return page == NULL ? T() : page[p.idx & (PAGESIZE - 1)];
+     }
+     // writable reference to a REG or MEM parameter, allocating its page
+     T &ref(const Parameter &p) {
+          if (p.ty == Parameter::REG)
+               return regs[p.reg * 4 + p.idx];
+          T *&page = pages[p.idx >> PAGEBITS];
+          if (page == NULL)
+               page = new T[PAGESIZE]();
+          return page[p.idx & (PAGESIZE - 1)];
+     }
+};
+
 string reg2string(Register reg);
+int parseLocation(string s, vector<Parameter> *v);
+int parseRange(string s, int *first, int *last);
+
+// LEB128 varints for compact on-disk streams
+void putVarint(vector<uint8_t> *buf, uint64_t v);
+const uint8_t *getVarint(const uint8_t *p, uint64_t *v);
+
+uint64_t hashInstSeq(list<Inst>::iterator begin, list<Inst>::iterator end);
+bool sameInstSeq(list<Inst>::iterator b1, list<Inst>::iterator e1,
+                 list<Inst>::iterator b2, list<Inst>::iterator e2);
+int findPeriod(const vector<int> &seq, size_t pos, int maxp, int *reps);
@@ -0,0 +1,671 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include <cctype>
+#include <thread>
+
+using namespace std;
+
+#include "core.hpp"
+#include "extract.hpp"
+
+// jmp instruction names in x86 assembly
+string jmpInstrName[33] = {"jo","jno","js","jns","je","jz","jne",
+                           "jnz","jb","jnae","jc","jnb","jae",
+                           "jnc","jbe","jna","ja","jnbe","jl",
+                           "jnge","jge","jnl","jle","jng","jg",
+                           "jnle","jp","jpe","jnp","jpo","jcxz",
+                           "jecxz", "jmp"};
+
+set<int> *jmpset;        // jmp instructions
+map<string, int> *instenum;     // instruction enumerations
+
+map<string, int> *buildOpcodeMap(list<Inst> *L)
+{
+     map<string, int> *instenum = new map<string, int>;
+     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
+          if (instenum->find(it->opcstr) == instenum->end())
+               instenum->insert(pair<string, int>(it->opcstr, instenum->size()+1));
+     }
+
+     return instenum;
+}
+
+int getOpc(string s, map<string, int> *m)
+{
+     map<string, int>::iterator it = m->find(s);
+     if (it != m->end())
+          return it->second;
+     else
+          return 0;
+}
+
+bool isjump(int i, set<int> *jumpset)
+{
+     set<int>::iterator it = jumpset->find(i);
+     if (it == jumpset->end())
+          return false;
+     else
+          return true;
+}
+
+// Peephole rules: an instruction with opcode first directly followed by one
+// with opcode second cancel out when their first nopr operands are equal.
+struct PeepRule {
+     string first, second;
+     int nopr;
+};
+
+PeepRule peeprules[] = {
+     {"pushad", "popad", 0},
+     {"popad", "pushad", 0},
+     {"push", "pop", 1},
+     {"pop", "push", 1},
+     {"add", "sub", 2},
+     {"sub", "add", 2},
+     {"inc", "dec", 1},
+     {"dec", "inc", 1},
+};
+
+// Remove cancelling instruction pairs in one pass. The kept instructions
+// before it act as a stack: when it cancels with the one on top, both are
+// erased and the one below becomes the top, so nested pairs such as
+// push a; push b; pop b; pop a are removed as well.
+void peephole(list<Inst> *L)
+{
+     const int nrule = sizeof(peeprules) / sizeof(peeprules[0]);
+
+     // rules indexed by the opcode of their first instruction
+     map<int, vector<pair<int, int> > > rules;     // opc -> (rule, opc of second)
+     for (int i = 0; i < nrule; ++i) {
+          int opc1 = getOpc(peeprules[i].first, instenum);
+          int opc2 = getOpc(peeprules[i].second, instenum);
+          if (opc1 != 0 && opc2 != 0)
+               rules[opc1].push_back(make_pair(i, opc2));
+     }
+     vector<int> removed(nrule, 0);
+
+     for (list<Inst>::iterator it = L->begin(); it != L->end(); ) {
+          if (it == L->begin()) {
+               ++it;
+               continue;
+          }
+          list<Inst>::iterator top = prev(it);
+          map<int, vector<pair<int, int> > >::iterator r = rules.find(top->opc);
+          int match = -1;
+          if (r != rules.end()) {
+               for (int i = 0, max = r->second.size(); i < max && match < 0; ++i) {
+                    if (r->second[i].second != it->opc) continue;
+                    int rule = r->second[i].first;
+                    int nopr = peeprules[rule].nopr;
+                    if ((int)top->oprs.size() < nopr || (int)it->oprs.size() < nopr) continue;
+                    if (equal(top->oprs.begin(), top->oprs.begin() + nopr, it->oprs.begin()))
+                         match = rule;
+               }
+          }
+          if (match < 0) {
+               ++it;
+               continue;
+          }
+          L->erase(top);
+          it = L->erase(it);
+          removed[match] += 2;
+     }
+
+     for (int i = 0; i < nrule; ++i) {
+          if (removed[i] != 0)
+               fprintf(stderr, "peephole %s/%s: %d instructions removed\n",
+                       peeprules[i].first.c_str(), peeprules[i].second.c_str(), removed[i]);
+     }
+}
+
+list<ctxswitch> ctxsave;                  // context save instructions
+list<ctxswitch> ctxrestore;               // context restore instructions
+list<pair<ctxswitch, ctxswitch> > ctxswh;            // paired context switch instructions
+
+// Context save and restore patterns. Each rule describes a run of element
+// instructions, e.g. pushes of distinct registers, which may be interleaved
+// with filler instructions. A rule is one line of a rule file:
+//
+//   save|restore <name> opc=<opcodes> [regs=<keys>] [filler=<opcodes>] [min=<n>] [max=<n>]
+//
+// The key of an element is its register operand, "imm" for an immediate, or
+// its opcode if it has no operand. Keys in a run are distinct; without regs=
+// any key is allowed. Lists are separated by commas, '#' starts a comment.
+vector<CtxRule> ctxrules;
+
+// the rules used when no rule file is given: seven distinct register pushes
+// or pops, as VMProtect and Code Virtualizer do
+string ctxdefaults[] = {
+     "save ctxsave opc=push regs=eax,ebx,ecx,edx,esi,edi,ebp min=7 max=7",
+     "restore ctxrestore opc=pop regs=eax,ebx,ecx,edx,esi,edi,ebp min=7 max=7"
+};
+
+set<string> splitlist(string s)
+{
+     set<string> r;
+     istringstream strbuf(s);
+     string item;
+     while (getline(strbuf, item, ',')) {
+          if (!item.empty())
+               r.insert(item);
+     }
+     return r;
+}
+
+// parse one rule, return 0 on success
+int parseCtxRule(string line, CtxRule *r)
+{
+     istringstream strbuf(line);
+     string kind, field;
+
+     if (!(strbuf >> kind >> r->name) || (kind != "save" && kind != "restore"))
+          return 1;
+     r->save = (kind == "save");
+     r->min = 1;
+     r->max = 64;
+
+     while (strbuf >> field) {
+          size_t eq = field.find('=');
+          if (eq == string::npos)
+               return 1;
+          string key = field.substr(0, eq), val = field.substr(eq + 1);
+          if (key == "opc") {
+               r->opcs = splitlist(val);
+          } else if (key == "regs") {
+               r->regs = splitlist(val);
+          } else if (key == "filler") {
+               r->filler = splitlist(val);
+          } else if (key == "min") {
+               r->min = atoi(val.c_str());
+          } else if (key == "max") {
+               r->max = atoi(val.c_str());
+          } else {
+               return 1;
+          }
+     }
+
+     // keys and elements are bits of a 64 bit mask
+     if (r->opcs.empty() || r->regs.size() > 64 || r->min < 1 || r->max < r->min || r->max > 64)
+          return 1;
+     return 0;
+}
+
+int readCtxRules(string fname, vector<CtxRule> *R)
+{
+     ifstream infile(fname);
+     if (!infile.is_open()) {
+          fprintf(stderr, "Open rule file error!\n");
+          return 1;
+     }
+
+     string line;
+     while (getline(infile, line)) {
+          size_t hash = line.find('#');
+          if (hash != string::npos)
+               line.erase(hash);
+          if (line.find_first_not_of(" \t\r") == string::npos) continue;
+
+          CtxRule r;
+          if (parseCtxRule(line, &r) != 0) {
+               fprintf(stderr, "Bad context switch rule: %s\n", line.c_str());
+               return 1;
+          }
+          R->push_back(r);
+     }
+
+     return 0;
+}
+
+// key of an instruction as a rule element
+string ctxkey(Inst &ins)
+{
+     if (ins.oprnum == 0)
+          return ins.opcstr;
+     if (isdigit(ins.oprs[0][0]))
+          return "imm";
+     return ins.oprs[0];
+}
+
+// A rule compiled against the opcodes of the trace. Every opcode maps to an
+// action, and every element key to a bit of the run's key mask.
+struct CtxAutomaton {
+     enum Action {BREAK, ELEMENT, FILLER};
+
+     CtxRule *rule;
+     vector<char> action;               // indexed by opc
+     map<string, int> keybit;           // allowed keys, empty for any key
+
+     // current run: its elements, pending while not yet emitted
+     deque<pair<list<Inst>::iterator, int> > run;
+     uint64_t mask;
+     bool pending;
+
+     // without regs=, the keys of the run and their bits, numbered per run
+     map<string, int> runkey;
+     string bitkey[64];
+
+     // where the records go
+     list<ctxswitch> *save, *restore;
+     ostream *log;
+
+     void compile(CtxRule *r, map<string, int> *opcmap) {
+          rule = r;
+          save = &ctxsave;
+          restore = &ctxrestore;
+          log = &cout;
+          action.assign(opcmap->size() + 1, BREAK);
+          for (set<string>::iterator i = r->filler.begin(); i != r->filler.end(); ++i) {
+               int opc = getOpc(*i, opcmap);
+               if (opc != 0) action[opc] = FILLER;
+          }
+          for (set<string>::iterator i = r->opcs.begin(); i != r->opcs.end(); ++i) {
+               int opc = getOpc(*i, opcmap);
+               if (opc != 0) action[opc] = ELEMENT;
+          }
+          for (set<string>::iterator i = r->regs.begin(); i != r->regs.end(); ++i) {
+               int n = keybit.size();
+               keybit[*i] = n;
+          }
+          reset();
+     }
+     void reset() {
+          run.clear();
+          mask = 0;
+          pending = false;
+          runkey.clear();
+     }
+     // drop the first element of the run
+     void popfront() {
+          int bit = run.front().second;
+          mask &= ~(1ULL << bit);
+          if (rule->regs.empty())
+               runkey.erase(bitkey[bit]);
+          run.pop_front();
+     }
+};
+
+// bit of key in the run mask of a, or -1 if key is not an element of a.
+// Rules without regs= number the keys of each run on their own, so any key
+// is an element; a key not in the run yet returns 64 and gets a bit when it
+// is added.
+int getkeybit(CtxAutomaton *a, string key)
+{
+     map<string, int> *m = a->rule->regs.empty() ? &a->runkey : &a->keybit;
+     map<string, int>::iterator i = m->find(key);
+     if (i != m->end())
+          return i->second;
+     return m == &a->keybit ? -1 : 64;
+}
+
+// emit the current run of a as a context switch record
+void emitctx(CtxAutomaton *a, list<Inst> *L)
+{
+     ctxswitch cs;
+     cs.begin = a->run.front().first;
+     cs.end   = next(a->run.back().first);
+     a->pending = false;
+     if (a->rule->save) {
+          // the stack depth after the save is needed
+          if (cs.end == L->end())
+               return;
+          cs.sd = cs.end->ctxreg[6];
+          a->save->push_back(cs);
+          *a->log << "push found" << endl;
+     } else {
+          cs.sd = cs.begin->ctxreg[6];
+          a->restore->push_back(cs);
+     }
+     *a->log << cs.begin->id << " " << cs.begin->addr << " " << cs.begin->assembly << endl;
+}
+
+// end the current run of a, emitting it if it is long enough
+void endrun(CtxAutomaton *a, list<Inst> *L)
+{
+     if (a->pending && (int)a->run.size() >= a->rule->min)
+          emitctx(a, L);
+     a->reset();
+}
+
+// advance a over the instruction it
+void stepctx(CtxAutomaton *a, list<Inst> *L, list<Inst>::iterator it)
+{
+     char act = a->action[it->opc];
+     int bit = -1;
+     string key;
+     if (act == CtxAutomaton::ELEMENT && (bit = getkeybit(a, key = ctxkey(*it))) < 0)
+          act = CtxAutomaton::BREAK;
+
+     if (act == CtxAutomaton::FILLER)
+          return;
+     if (act == CtxAutomaton::BREAK) {
+          endrun(a, L);
+          return;
+     }
+
+     // a repeated key ends the run and a new one starts after its
+     // previous occurrence; a full run slides by one element
+     if (bit < 64 && (a->mask & (1ULL << bit))) {
+          if (a->pending && (int)a->run.size() >= a->rule->min)
+               emitctx(a, L);
+          while (a->mask & (1ULL << bit))
+               a->popfront();
+     } else if ((int)a->run.size() == a->rule->max) {
+          a->popfront();
+     }
+
+     // a run is shorter than max <= 64 here, so a bit is free
+     if (bit == 64) {
+          bit = 0;
+          while (a->mask & (1ULL << bit))
+               ++bit;
+     }
+     if (a->rule->regs.empty()) {
+          a->runkey[key] = bit;
+          a->bitkey[bit] = key;
+     }
+     a->run.push_back(make_pair(it, bit));
+     a->mask |= 1ULL << bit;
+     a->pending = true;
+     if ((int)a->run.size() == a->rule->max)
+          emitctx(a, L);
+}
+
+// Pair each context save with the next restore at the same stack depth.
+// Saves and restores are merged in trace order, and each stack depth keeps
+// a stack of the saves still open, so nested VM entries pair innermost
+// first and a recurring stack depth does not pair across invocations.
+void pairctx()
+{
+     unordered_map<ADDR32, vector<list<ctxswitch>::iterator> > open;
+     map<int, ctxswitch> matched;       // save id -> its restore
+
+     list<ctxswitch>::iterator i = ctxsave.begin(), ii = ctxrestore.begin();
+     while (ii != ctxrestore.end()) {
+          if (i != ctxsave.end() && i->begin->id < ii->begin->id) {
+               open[i->sd].push_back(i);
+               ++i;
+               continue;
+          }
+          unordered_map<ADDR32, vector<list<ctxswitch>::iterator> >::iterator s = open.find(ii->sd);
+          if (s != open.end() && !s->second.empty()) {
+               matched[s->second.back()->begin->id] = *ii;
+               s->second.pop_back();
+          }
+          ++ii;
+     }
+
+     for (i = ctxsave.begin(); i != ctxsave.end(); ++i) {
+          map<int, ctxswitch>::iterator m = matched.find(i->begin->id);
+          if (m != matched.end())
+               ctxswh.push_back(pair<ctxswitch,ctxswitch>(*i, m->second));
+     }
+}
+
+// whether the instruction it ends the run of every automaton whatever its
+// state, so that the automata are all reset after it
+bool isreset(vector<CtxAutomaton> *autom, list<Inst>::iterator it)
+{
+     for (int i = 0, max = autom->size(); i < max; ++i) {
+          CtxAutomaton *a = &(*autom)[i];
+          char act = a->action[it->opc];
+          if (act == CtxAutomaton::FILLER)
+               return false;
+          if (act == CtxAutomaton::ELEMENT &&
+              (a->rule->regs.empty() || a->keybit.find(ctxkey(*it)) != a->keybit.end()))
+               return false;
+     }
+     return true;
+}
+
+// A range of the trace searched by one thread, with its own automata and
+// records. The range starts after a reset instruction, or at the start of
+// the trace, and ends after the next one, so runs never cross ranges.
+struct CtxChunk {
+     list<Inst>::iterator begin, end;
+     vector<CtxAutomaton> autom;
+     list<ctxswitch> save, restore;
+     ostringstream log;
+};
+
+void scanChunk(list<Inst> *L, CtxChunk *c)
+{
+     for (list<Inst>::iterator it = c->begin; it != c->end; ++it) {
+          for (int i = 0, max = c->autom.size(); i < max; ++i) {
+               stepctx(&c->autom[i], L, it);
+          }
+     }
+     for (int i = 0, max = c->autom.size(); i < max; ++i) {
+          endrun(&c->autom[i], L);
+     }
+}
+
+// Search the instruction list L and extract VM snippets. Every context
+// switch rule runs as an automaton over the trace, all in the same pass.
+// With nthread > 1 the trace is split into chunks searched in parallel. A
+// chunk boundary is moved to the first reset instruction of the chunk, where
+// a sequential search has no open run either, so the chunks find exactly the
+// records of one pass. Saves and restores are then paired over the trace.
+void vmextract(list<Inst> *L, int nthread)
+{
+     if (ctxrules.empty()) {
+          for (string &line : ctxdefaults) {
+               CtxRule r;
+               parseCtxRule(line, &r);
+               ctxrules.push_back(r);
+          }
+     }
+
+     vector<CtxAutomaton> autom(ctxrules.size());
+     for (int i = 0, max = ctxrules.size(); i < max; ++i) {
+          autom[i].compile(&ctxrules[i], instenum);
+     }
+
+     size_t n = L->size();
+     if (nthread < 1)
+          nthread = 1;
+     if ((size_t)nthread > n / 1024 + 1)
+          nthread = n / 1024 + 1;
+
+     if (nthread == 1) {
+          for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
+               for (int i = 0, max = autom.size(); i < max; ++i) {
+                    stepctx(&autom[i], L, it);
+               }
+          }
+          for (int i = 0, max = autom.size(); i < max; ++i) {
+               endrun(&autom[i], L);
+          }
+     } else {
+          // even split of the list, then each boundary after its first reset
+          vector<list<Inst>::iterator> bound(nthread + 1, L->end());
+          list<Inst>::iterator it = L->begin();
+          for (size_t i = 0, c = 0; it != L->end(); ++it, ++i) {
+               if (i == n * c / nthread)
+                    bound[c++] = it;
+          }
+          vector<list<Inst>::iterator> start(nthread, L->end());
+          start[0] = L->begin();
+          vector<thread> workers;
+          for (int c = 1; c < nthread; ++c) {
+               workers.push_back(thread([&, c]() {
+                    list<Inst>::iterator i = bound[c];
+                    while (i != bound[c + 1] && !isreset(&autom, i))
+                         ++i;
+                    if (i != bound[c + 1])
+                         start[c] = next(i);
+               }));
+          }
+          for (int c = 0; c < nthread - 1; ++c) {
+               workers[c].join();
+          }
+          workers.clear();
+
+          // a chunk without a reset is searched by the chunk before it
+          CtxChunk *chunks = new CtxChunk[nthread];
+          for (int c = 0; c < nthread; ++c) {
+               chunks[c].begin = start[c];
+               int d = c + 1;
+               while (d < nthread && start[d] == L->end())
+                    ++d;
+               chunks[c].end = d < nthread ? start[d] : L->end();
+               chunks[c].autom = autom;
+               for (int i = 0, max = autom.size(); i < max; ++i) {
+                    chunks[c].autom[i].save = &chunks[c].save;
+                    chunks[c].autom[i].restore = &chunks[c].restore;
+                    chunks[c].autom[i].log = &chunks[c].log;
+               }
+               workers.push_back(thread(scanChunk, L, &chunks[c]));
+          }
+          for (int c = 0; c < nthread; ++c) {
+               workers[c].join();
+               cout << chunks[c].log.str();
+               ctxsave.splice(ctxsave.end(), chunks[c].save);
+               ctxrestore.splice(ctxrestore.end(), chunks[c].restore);
+          }
+          delete[] chunks;
+     }
+
+     // records of several rules are merged into trace order
+     ctxsave.sort([](const ctxswitch &a, const ctxswitch &b) { return a.begin->id < b.begin->id; });
+     ctxrestore.sort([](const ctxswitch &a, const ctxswitch &b) { return a.begin->id < b.begin->id; });
+
+     pairctx();
+}
+
+// write the instructions [i1, i2) to fname in the trace format
+void outputTrace(list<Inst>::iterator i1, list<Inst>::iterator i2, string fname)
+{
+     FILE *fp = fopen(fname.c_str(), "w");
+
+     for (list<Inst>::iterator ii = i1; ii != i2; ++ii) {
+          fprintf(fp, "%s;%s;", ii->addr.c_str(), ii->assembly.c_str());
+          for (int j = 0; j < 8; ++j) {
+               fprintf(fp, "%x,", ii->ctxreg[j]);
+          }
+          fprintf(fp, "%x,%x\n", ii->raddr, ii->waddr);
+     }
+
+     fclose(fp);
+}
+
+SnippetTree::SnippetTree(list<pair<ctxswitch, ctxswitch> > *ctxswh)
+{
+     int n = 1;
+     for (list<pair<ctxswitch,ctxswitch> >::iterator i = ctxswh->begin(); i != ctxswh->end(); ++i) {
+          Snippet s;
+          s.n = n++;
+          s.first = i->first.begin->id;
+          s.last = prev(i->second.end)->id;
+          s.parent = 0;
+          s.depth = 0;
+          sn.push_back(s);
+     }
+     sort(sn.begin(), sn.end(), [](const Snippet &a, const Snippet &b) {
+               return a.first < b.first || (a.first == b.first &&
+                      (a.last > b.last || (a.last == b.last && a.n < b.n)));
+          });
+
+     // the snippets before i all start no later, so its parent is the first
+     // of them on the links up from i - 1 that ends no earlier
+     up.resize(sn.size());
+     for (int i = 0, max = sn.size(); i < max; ++i) {
+          up[i] = climb(i - 1, sn[i].last);
+          if (up[i] >= 0) {
+               sn[i].parent = sn[up[i]].n;
+               sn[i].depth = sn[up[i]].depth + 1;
+          } else {
+               top.push_back(i);
+          }
+     }
+}
+
+// Follow the links up from snippet c to the first one ending at last or
+// later. Every snippet passed ends before last, so it lies inside the one
+// sought, which is therefore on the way. Of identical snippets the one with
+// the smallest number, which comes first, is taken.
+int SnippetTree::climb(int c, int last) const
+{
+     while (c >= 0 && sn[c].last < last)
+          c = up[c];
+     while (c >= 0 && up[c] >= 0 && sn[up[c]].first == sn[c].first && sn[up[c]].last == sn[c].last)
+          c = up[c];
+     return c;
+}
+
+// the innermost snippet containing the ids first-last: the last snippet
+// starting no later than first, or its nearest ancestor ending no earlier
+// than last
+int SnippetTree::innermost(int first, int last) const
+{
+     int c = upper_bound(sn.begin(), sn.end(), first, [](int id, const Snippet &s) {
+               return id < s.first;
+          }) - sn.begin() - 1;
+     return climb(c, last);
+}
+
+// the number of the snippet that snippet n, with ids first-last, is nested
+// in, or 0 for a top-level one
+int SnippetTree::nestedin(int n, int first, int last) const
+{
+     int c = innermost(first, last);
+     if (c < 0) return 0;
+     return sn[c].n != n ? sn[c].n : sn[c].parent;
+}
+
+// write the snippets as id ranges into the trace to vmsnippets.txt, one
+// "N first last parent" line per snippet, parent 0 for top-level snippets
+void outputManifest(list<pair<ctxswitch, ctxswitch> > *ctxswh, string tracefile)
+{
+     SnippetTree tree(ctxswh);
+
+     FILE *fp = fopen("vmsnippets.txt", "w");
+
+     fprintf(fp, "# trace %s, %d snippets, %d top-level\n", tracefile.c_str(), tree.size(),
+             (int)tree.toplevel().size());
+     int n = 1;
+     for (list<pair<ctxswitch,ctxswitch> >::iterator i = ctxswh->begin(); i != ctxswh->end(); ++i, ++n) {
+          int first = i->first.begin->id;
+          int last = prev(i->second.end)->id;
+          fprintf(fp, "%d %d %d %d\n", n, first, last, tree.nestedin(n, first, last));
+     }
+
+     fclose(fp);
+}
+
+void outputvm(list<pair<ctxswitch, ctxswitch> > *ctxswh)
+{
+     int n = 1;
+     for (list<pair<ctxswitch,ctxswitch> >::iterator i = ctxswh->begin(); i != ctxswh->end(); ++i) {
+          outputTrace(i->first.begin, i->second.end, "vm" + to_string(n++) + ".txt");
+     }
+}
+
+void preprocess(list<Inst> *L)
+{
+     // build global instruction enum based on the instlist
+     instenum = buildOpcodeMap(L);
+
+     // update opc field in L
+     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
+          it->opc = getOpc(it->opcstr, instenum);
+     }
+
+     // create a set containing the opcodes of all jump instructions
+     jmpset = new set<int>;
+     for (string &s : jmpInstrName) {
+          int n;
+          if ((n = getOpc(s, instenum)) != 0) {
+               jmpset->insert(n);
+          }
+     }
+
+}
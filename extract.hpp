@@ -0,0 +1,64 @@
+struct ctxswitch {
+     list<Inst>::iterator begin;
+     list<Inst>::iterator end;
+     ADDR32 sd;         // stack depth
+};
+
+// A VM snippet: the instruction ids of a paired save and restore. parent is
+// the number of the innermost snippet containing it, 0 for a top-level one.
+struct Snippet {
+     int n;             // number of the pair in ctxswh, from 1
+     int first, last;
+     int parent;
+     int depth;
+};
+
+// The snippets as an interval tree keyed by instruction id. They are kept
+// sorted by first id, and every snippet links to the innermost one that
+// contains it, so a lookup is a binary search on the first id followed by a
+// walk up the links, O(log n + depth).
+class SnippetTree {
+     vector<Snippet> sn;        // by first id, then by last id descending
+     vector<int> up;            // index of the parent, -1 at the top level
+     vector<int> top;
+
+     int climb(int c, int last) const;
+
+public:
+     SnippetTree(list<pair<ctxswitch, ctxswitch> > *ctxswh);
+     int innermost(int first, int last) const;    // snippet index, or -1
+     int innermost(int id) const { return innermost(id, id); }
+     int nestedin(int n, int first, int last) const;
+     const vector<int> &toplevel() const { return top; }
+     const Snippet &operator[](int i) const { return sn[i]; }
+     int size() const { return sn.size(); }
+};
+
+// a context save or restore pattern, see readCtxRules
+struct CtxRule {
+     bool save;         // save or restore
+     string name;
+     set<string> opcs;  // opcodes of elements
+     set<string> regs;  // allowed element keys, empty for any
+     set<string> filler;  // opcodes allowed between elements
+     int min, max;      // number of elements
+};
+
+extern string jmpInstrName[33];
+extern set<int> *jmpset;                                 // jmp instructions
+extern map<string, int> *instenum;                       // instruction enumerations
+extern list<ctxswitch> ctxsave;                          // context save instructions
+extern list<ctxswitch> ctxrestore;                       // context restore instructions
+extern list<pair<ctxswitch, ctxswitch> > ctxswh;         // paired context switch instructions
+extern vector<CtxRule> ctxrules;                         // context switch patterns
+
+map<string, int> *buildOpcodeMap(list<Inst> *L);
+int getOpc(string s, map<string, int> *m);
+bool isjump(int i, set<int> *jumpset);
+void preprocess(list<Inst> *L);
+void peephole(list<Inst> *L);
+int readCtxRules(string fname, vector<CtxRule> *R);
+void vmextract(list<Inst> *L, int nthread = 1);
+void outputTrace(list<Inst>::iterator i1, list<Inst>::iterator i2, string fname);
+void outputManifest(list<pair<ctxswitch, ctxswitch> > *ctxswh, string tracefile);
+void outputvm(list<pair<ctxswitch, ctxswitch> > *ctxswh);
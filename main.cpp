@@ -1,10 +1,13 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <list>
 #include <map>
 #include <vector>
 #include <set>
+#include <unistd.h>
+#include <climits>
 
 using namespace std;
 
@@ -14,28 +17,115 @@ using namespace std;
 
 list<Inst> instlist1, instlist2;     // all instructions in the trace
 
+// read the instruction ids of a slice into a bitmap
+int readSlice(string fname, vector<bool> *slice)
+{
+     ifstream infile(fname);
+     if (!infile.is_open()) {
+          fprintf(stderr, "Open slice file error!\n");
+          return 1;
+     }
+
+     int id;
+     while (infile >> id) {
+          if (id < 0) continue;
+          if (id >= (int)slice->size())
+               slice->resize(id + 1, false);
+          (*slice)[id] = true;
+     }
+
+     return 0;
+}
+
+// read handler instances as id ranges first-last, e.g. from the
+// handlers.txt of vmextract; other words are ignored
+int readHandlers(string fname, map<int, int> *handlers)
+{
+     ifstream infile(fname);
+     if (!infile.is_open()) {
+          fprintf(stderr, "Open handler file error!\n");
+          return 1;
+     }
+
+     string word;
+     while (infile >> word) {
+          int first, last;
+          char dash;
+          istringstream strbuf(word);
+          if (strbuf >> first >> dash >> last && dash == '-' && first <= last)
+               (*handlers)[first] = last;
+     }
+
+     return 0;
+}
+
 int main(int argc, char **argv) {
-     if (argc != 2) {
-          fprintf(stderr, "usage: %s <target>\n", argv[0]);
+     string slicefile, handlerfile;
+     int first = 1, last = INT_MAX;
+     int opt;
+
+     while ((opt = getopt(argc, argv, "v:s:h:")) != -1) {
+          switch (opt) {
+          case 'v':
+               if (parseRange(optarg, &first, &last) != 0) {
+                    fprintf(stderr, "Bad instruction range %s\n", optarg);
+                    return 1;
+               }
+               break;
+          case 's':
+               slicefile = optarg;
+               break;
+          case 'h':
+               handlerfile = optarg;
+               break;
+          default:
+               fprintf(stderr, "usage: %s [-v first-last] [-s sliceids | -h handlers] <target>\n", argv[0]);
+               return 1;
+          }
+     }
+     if (optind != argc - 1 || (!slicefile.empty() && !handlerfile.empty())) {
+          fprintf(stderr, "usage: %s [-v first-last] [-s sliceids | -h handlers] <target>\n", argv[0]);
           return 1;
      }
-     ifstream infile1(argv[1]);
+
+     vector<bool> slice;
+     if (!slicefile.empty() && readSlice(slicefile, &slice) != 0)
+          return 1;
+     map<int, int> handlers;
+     if (!handlerfile.empty() && readHandlers(handlerfile, &handlers) != 0)
+          return 1;
+
+     ifstream infile1(argv[optind]);
 
      if (!infile1.is_open()) {
           fprintf(stderr, "Open file error!\n");
           return 1;
      }
 
-     parseTrace(&infile1, &instlist1);
+     parseTrace(&infile1, &instlist1, first, last);
 
      infile1.close();
 
+     if (instlist1.empty()) {
+          if (last == INT_MAX)
+               fprintf(stderr, "Empty trace!\n");
+          else
+               fprintf(stderr, "No instructions in view %d-%d!\n", first, last);
+          return 1;
+     }
+
      parseOperand(instlist1.begin(), instlist1.end());
 
      SEEngine *se1 = new SEEngine();
      se1->initAllRegSymol(instlist1.begin(), instlist1.end());
+     if (!slicefile.empty())
+          se1->setSlice(&slice);
+     if (!handlerfile.empty())
+          se1->setHandlers(&handlers);
      se1->symexec();
      se1->dumpreg("eax");
+     if (!handlerfile.empty())
+          fprintf(stderr, "%d handler summaries for %d instances\n", se1->nsummaries(), (int)handlers.size());
 
      return 0;
 }
@@ -7,6 +7,7 @@
 #include <queue>
 #include <bitset>
 #include <sstream>
+#include <cstdint>
 
 using namespace std;
 
@@ -29,6 +30,7 @@ struct Value {
      int len;                            // length of the value
 
      static int idseed;
+     static vector<Value*> *pool;        // owner of new values, NULL for none
 
      Value(ValueTy vty);
      Value(ValueTy vty, int l);
@@ -37,6 +39,7 @@ struct Value {
      Value(ValueTy vty, Operation *oper);
      Value(ValueTy vty, Operation *oper, int l);
      Value(ValueTy vty, bitset<32> bs);
+     ~Value();
 
      bool isSymbol();
      bool isConcrete();
@@ -44,10 +47,12 @@ struct Value {
 };
 
 int Value::idseed = 0;
+vector<Value*> *Value::pool = NULL;
 
 Value::Value(ValueTy vty) : opr(NULL)
 {
      id = ++idseed;
+     if (pool != NULL) pool->push_back(this);
      valty = vty;
      len = 32;
 }
@@ -55,6 +60,7 @@ Value::Value(ValueTy vty) : opr(NULL)
 Value::Value(ValueTy vty, int l) : opr(NULL)
 {
      id = ++idseed;
+     if (pool != NULL) pool->push_back(this);
      valty = vty;
      len = l;
 }
@@ -62,6 +68,7 @@ Value::Value(ValueTy vty, int l) : opr(NULL)
 Value::Value(ValueTy vty, string con) : opr(NULL),bsconval(stoul(con, 0, 16))
 {
      id = ++idseed;
+     if (pool != NULL) pool->push_back(this);
      valty = vty;
      conval = con;
      brange.first = 0;
@@ -72,6 +79,7 @@ Value::Value(ValueTy vty, string con) : opr(NULL),bsconval(stoul(con, 0, 16))
 Value::Value(ValueTy vty, string con, int l) : opr(NULL)
 {
      id = ++idseed;
+     if (pool != NULL) pool->push_back(this);
      valty = vty;
      conval = con;
      len = l;
@@ -80,6 +88,7 @@ Value::Value(ValueTy vty, string con, int l) : opr(NULL)
 Value::Value(ValueTy vty, bitset<32> bs) : opr(NULL)
 {
      id = ++idseed;
+     if (pool != NULL) pool->push_back(this);
      valty = vty;
      bsconval = bs;
      len = 32;
@@ -88,6 +97,7 @@ Value::Value(ValueTy vty, bitset<32> bs) : opr(NULL)
 Value::Value(ValueTy vty, Operation *oper)
 {
      id = ++idseed;
+     if (pool != NULL) pool->push_back(this);
      valty = vty;
      opr = oper;
      len = 32;
@@ -96,11 +106,21 @@ Value::Value(ValueTy vty, Operation *oper)
 Value::Value(ValueTy vty, Operation *oper, int l)
 {
      id = ++idseed;
+     if (pool != NULL) pool->push_back(this);
      valty = vty;
      opr = oper;
      len = l;
 }
 
+// While a PoolGuard lives, new values are owned by its engine. Guards nest,
+// as the engine summarizing a handler runs inside another one.
+struct PoolGuard {
+     vector<Value*> *saved;
+
+     PoolGuard(vector<Value*> *p) : saved(Value::pool) { Value::pool = p; }
+     ~PoolGuard() { Value::pool = saved; }
+};
+
 
 bool Value::isSymbol()
 {
@@ -168,6 +188,11 @@ Operation::Operation(string opt, Value *v1, Value *v2, Value *v3)
      val[2] = v3;
 }
 
+Value::~Value()
+{
+     delete opr;
+}
+
 Value *buildop1(string opty, Value *v1)
 {
      Operation *oper = new Operation(opty, v1);
@@ -621,6 +646,7 @@ void SEEngine::init(list<Inst>::iterator it1,
 void SEEngine::initAllRegSymol(list<Inst>::iterator it1,
                                list<Inst>::iterator it2)
 {
+     PoolGuard guard(&values);
      Value *v1 = new Value(SYMBOL);
      Value *v2 = new Value(SYMBOL);
      Value *v3 = new Value(SYMBOL);
@@ -660,14 +686,269 @@ set<string> noeffectinst = {"test","jmp","jz","jbe","jo","jno","js","jns","je","
                             "jnle","jp","jpe","jnp","jpo","jcxz",
                             "jecxz", "ret", "cmp", "call"};
 
+// Set the registers written by the skipped instruction it to their concrete
+// values, taken from the context of the next instruction in the trace. Only
+// the bytes it writes are replaced: a partial register write (al, ah, ax) is
+// masked into the current value, so symbolic bytes still read by the slice
+// are kept. Memory written by a skipped instruction is never read by an
+// instruction in the slice, so it is left as it is.
+void SEEngine::concretize(list<Inst>::iterator it)
+{
+     static const string regname[8] = {"eax", "ebx", "ecx", "edx", "esi", "edi", "esp", "ebp"};
+
+     list<Inst>::iterator nit = next(it);
+     if (nit == end || noeffectinst.find(it->opcstr) != noeffectinst.end()) return;
+
+     for (int i = 0; i < it->oprnum && i < 2; ++i) {
+          bool iswritten = (i == 0 && it->opcstr != "push") || (i == 1 && it->opcstr == "xchg");
+          if (!iswritten || it->oprd[i]->ty != Operand::REG) continue;
+
+          string s = it->oprd[i]->field[0];
+          string r;
+          if (s.size() == 3)
+               r = s;                                   // eax
+          else if (s[1] == 'l' || s[1] == 'h')
+               r = 'e' + s.substr(0,1) + 'x';           // al, ah
+          else
+               r = "e" + s;                             // ax, si
+          for (int j = 0; j < 8; ++j) {
+               if (regname[j] != r) continue;
+               ADDR32 val = nit->ctxreg[j];
+               if (s.size() == 2 && s[1] == 'l')
+                    val &= 0xff;
+               else if (s.size() == 2 && s[1] == 'h')
+                    val = (val >> 8) & 0xff;
+               else if (s.size() == 2)
+                    val &= 0xffff;
+               stringstream strs;
+               strs << "0x" << hex << val;
+               writeReg(s, new Value(CONCRETE, strs.str()));
+          }
+     }
+}
+
+// A parametric summary of one handler instruction sequence: its outputs as
+// formulas over fresh input symbols for the registers and the memory it reads
+// at handler entry. Memory is identified by the index of the first access to
+// the same address in the handler, so the summary applies to every instance
+// whose accesses alias the same way.
+struct Summary {
+     Value *regin[8];
+     Value *regout[8];
+     vector<pair<int, Value*> > memin;                   // access, input symbol
+     vector<pair<pair<int, int>, Value*> > memout;        // (access, nbyte), value
+};
+
+static const string seregname[8] = {"eax", "ebx", "ecx", "edx", "esi", "edi", "esp", "ebp"};
+
+// the memory addresses accessed by [first, last], in order
+vector<ADDR32> memaccess(list<Inst>::iterator first, list<Inst>::iterator last)
+{
+     vector<ADDR32> acc;
+     for (list<Inst>::iterator it = first; it != next(last); ++it) {
+          if (it->raddr != 0) acc.push_back(it->raddr);
+          if (it->waddr != 0) acc.push_back(it->waddr);
+     }
+     return acc;
+}
+
+// Alias signature of the accesses: the distance of every pair of accesses
+// closer than 16 bytes. Two instances with the same signature have the same
+// overlapping accesses, at the same offsets.
+string aliassig(vector<ADDR32> &acc)
+{
+     stringstream sig;
+     for (int i = 0, max = acc.size(); i < max; ++i) {
+          for (int j = i + 1; j < max; ++j) {
+               int32_t d = acc[j] - acc[i];
+               if (d > -16 && d < 16)
+                    sig << i << "," << j << "," << d << ";";
+          }
+     }
+     return sig.str();
+}
+
+int accessidx(vector<ADDR32> &acc, ADDR32 addr)
+{
+     for (int i = 0, max = acc.size(); i < max; ++i) {
+          if (acc[i] == addr) return i;
+     }
+     return -1;
+}
+
+// copy the formula v with the values in sub substituted, rebuilding the
+// operations so that their types follow the new inputs
+Value *substitute(Value *v, map<Value*, Value*> *sub)
+{
+     if (v == NULL) return NULL;
+
+     map<Value*, Value*>::iterator i = sub->find(v);
+     if (i != sub->end())
+          return i->second;
+
+     Value *res;
+     if (v->opr != NULL) {
+          Operation *op = v->opr;
+          Value *v0 = substitute(op->val[0], sub);
+          Value *v1 = substitute(op->val[1], sub);
+          Value *v2 = substitute(op->val[2], sub);
+          if (v2 != NULL)
+               res = buildop3(op->opty, v0, v1, v2);
+          else if (v1 != NULL)
+               res = buildop2(op->opty, v0, v1);
+          else
+               res = buildop1(op->opty, v0);
+     } else if (v->isHybrid()) {
+          // hybrid values are updated in place by writeVal, never share them
+          res = new Value(HYBRID);
+          res->brange = v->brange;
+          for (map<BitRange, Value*>::iterator c = v->childs.begin(); c != v->childs.end(); ++c) {
+               res->childs[c->first] = substitute(c->second, sub);
+          }
+     } else {
+          res = v;
+     }
+     (*sub)[v] = res;
+     return res;
+}
+
+// free every value the engine allocated, and its summaries
+SEEngine::~SEEngine()
+{
+     for (int i = 0, max = values.size(); i < max; ++i) {
+          delete values[i];
+     }
+     for (map<pair<uint64_t, string>, Summary*>::iterator i = summaries.begin(); i != summaries.end(); ++i) {
+          delete i->second;
+     }
+}
+
+// Symbolically execute the handler instance [first, last] on fresh inputs
+// and build its summary, or return NULL if its memory cannot be expressed
+// by accesses of the handler
+Summary *SEEngine::summarize(list<Inst>::iterator first, list<Inst>::iterator last)
+{
+     SEEngine se;
+     se.initAllRegSymol(first, next(last));
+     int err = se.symexec();
+     // the summary refers to the values of se, which this engine keeps
+     values.insert(values.end(), se.values.begin(), se.values.end());
+     se.values.clear();
+     if (err != 0)
+          return NULL;
+
+     vector<ADDR32> acc = memaccess(first, last);
+     Summary *s = new Summary;
+     for (int i = 0; i < 8; ++i) {
+          s->regout[i] = se.ctx[seregname[i]];
+     }
+     for (map<Value*, string>::iterator i = se.reginput.begin(); i != se.reginput.end(); ++i) {
+          for (int j = 0; j < 8; ++j) {
+               if (seregname[j] == i->second) s->regin[j] = i->first;
+          }
+     }
+     for (map<Value*, AddrRange>::iterator i = se.meminput.begin(); i != se.meminput.end(); ++i) {
+          int k = accessidx(acc, i->second.first);
+          if (k < 0) {
+               delete s;
+               return NULL;
+          }
+          s->memin.push_back(make_pair(k, i->first));
+     }
+     for (map<AddrRange, Value*>::iterator i = se.mem.begin(); i != se.mem.end(); ++i) {
+          map<Value*, AddrRange>::iterator in = se.meminput.find(i->second);
+          if (in != se.meminput.end() && in->second == i->first)
+               continue;          // only read
+          int k = accessidx(acc, i->first.first);
+          if (k < 0) {
+               delete s;
+               return NULL;
+          }
+          s->memout.push_back(make_pair(make_pair(k, (int)(i->first.second - i->first.first + 1)), i->second));
+     }
+
+     return s;
+}
+
+// number of handler summaries built; a handler whose memory cannot be
+// summarized is cached as NULL and executed in full
+int SEEngine::nsummaries()
+{
+     int n = 0;
+     for (map<pair<uint64_t, string>, Summary*>::iterator i = summaries.begin(); i != summaries.end(); ++i) {
+          if (i->second != NULL) ++n;
+     }
+     return n;
+}
+
+// apply the summary s to the handler instance [first, last]: its inputs are
+// the current registers and memory, then its outputs are written back
+void SEEngine::applySummary(Summary *s, list<Inst>::iterator first, list<Inst>::iterator last)
+{
+     vector<ADDR32> acc = memaccess(first, last);
+     map<Value*, Value*> sub;
+
+     for (int i = 0; i < 8; ++i) {
+          sub[s->regin[i]] = ctx[seregname[i]];
+     }
+     for (int i = 0, max = s->memin.size(); i < max; ++i) {
+          Value *in = s->memin[i].second;
+          sub[in] = readMem(acc[s->memin[i].first], in->len);
+     }
+
+     Value *regout[8];
+     vector<Value*> memout;
+     for (int i = 0; i < 8; ++i) {
+          regout[i] = substitute(s->regout[i], &sub);
+     }
+     for (int i = 0, max = s->memout.size(); i < max; ++i) {
+          memout.push_back(substitute(s->memout[i].second, &sub));
+     }
+
+     for (int i = 0; i < 8; ++i) {
+          ctx[seregname[i]] = regout[i];
+     }
+     for (int i = 0, max = s->memout.size(); i < max; ++i) {
+          writeMem(acc[s->memout[i].first.first], s->memout[i].first.second, memout[i]);
+     }
+}
+
 int SEEngine::symexec()
 {
+     PoolGuard guard(&values);
      for (list<Inst>::iterator it = start; it != end; ++it) {
           // cout << hex << it->addrn << ": ";
           // cout << it->opcstr << '\n';
 
-          // skip no effect instructions
+          // execute only the instructions in the slice, if there is one
           ip = it;
+          if (slice != NULL && (it->id >= (int)slice->size() || !(*slice)[it->id])) {
+               concretize(it);
+               continue;
+          }
+
+          // a handler instance is executed once per distinct code and
+          // aliasing, and every instance applies the cached summary
+          map<int, int>::iterator h;
+          if (slice == NULL && handlers != NULL && (h = handlers->find(it->id)) != handlers->end()) {
+               list<Inst>::iterator last = it;
+               while (last->id != h->second && next(last) != end)
+                    ++last;
+               if (last->id == h->second) {
+                    pair<uint64_t, string> key(hashInstSeq(it, next(last)), "");
+                    vector<ADDR32> acc = memaccess(it, last);
+                    key.second = aliassig(acc);
+                    map<pair<uint64_t, string>, Summary*>::iterator c = summaries.find(key);
+                    Summary *sum = c != summaries.end() ? c->second : (summaries[key] = summarize(it, last));
+                    if (sum != NULL) {
+                         applySummary(sum, it, last);
+                         it = last;
+                         continue;
+                    }
+               }
+          }
+
+          // skip no effect instructions
           if (noeffectinst.find(it->opcstr) != noeffectinst.end()) continue;
 
           switch (it->oprnum) {
@@ -994,7 +1275,7 @@ int SEEngine::symexec()
                          }
 
                     }
-               } if (it->opcstr == "or") {
+               } else if (it->opcstr == "or") {
                     if (op0->ty == Operand::REG && op1->ty == Operand::IMM && readReg(op0->field[0])->isHybrid()) {
                          v0 = readReg(op0->field[0]);
                          v1 = new Value(CONCRETE, op1->field[0]);
@@ -1364,6 +1645,8 @@ ADDR32 eval(Value *v, map<Value*, ADDR32> *inmap)
                return ~op0 + 1;
           } else if (op->opty == "inc") {
                return op0 + 1;
+          } else if (op->opty == "mov") {
+               return op1;
           } else {
                cout << "Instruction: " << op->opty << "is not interpreted!" << endl;
                return 1;
@@ -1,5 +1,6 @@
 struct Operation;
 struct Value;
+struct Summary;
 
 // Symbolic execution engine
 class SEEngine {
@@ -12,6 +13,10 @@ private:
      map<AddrRange, Value*> mem;              // memory model
      map<Value*, AddrRange> meminput;         // inputs from memory
      map<Value*, string> reginput;            // inputs from registers
+     vector<bool> *slice;                     // ids of instructions to execute, NULL for all
+     map<int, int> *handlers;                 // first id -> last id of handler instances
+     map<pair<uint64_t, string>, Summary*> summaries;   // by code hash and alias signature
+     vector<Value*> values;                   // all values allocated by the engine
 
      bool memfind(AddrRange ar) {
           map<AddrRange, Value*>::iterator ii = mem.find(ar);
@@ -38,14 +43,20 @@ private:
      /* void readornew(int32_t addr, int nbyte, Value *&v); */
      ADDR32 getRegConVal(string reg);
      ADDR32 calcAddr(Operand *opr);
+     void concretize(list<Inst>::iterator it);
+     Summary *summarize(list<Inst>::iterator first, list<Inst>::iterator last);
+     void applySummary(Summary *s, list<Inst>::iterator first, list<Inst>::iterator last);
      void printformula(Value* v);
 
 public:
-     SEEngine() {
+     SEEngine() : slice(NULL), handlers(NULL) {
           ctx = { {"eax", NULL}, {"ebx", NULL}, {"ecx", NULL}, {"edx", NULL},
                   {"esi", NULL}, {"edi", NULL}, {"esp", NULL}, {"ebp", NULL}
           };
      };
+     ~SEEngine();
+     SEEngine(const SEEngine &) = delete;
+     SEEngine &operator=(const SEEngine &) = delete;
      void init(Value *v1, Value *v2, Value *v3, Value *v4,
                Value *v5, Value *v6, Value *v7, Value *v8,
                list<Inst>::iterator it1,
@@ -54,6 +65,9 @@ public:
                list<Inst>::iterator it2);
      void initAllRegSymol(list<Inst>::iterator it1,
                           list<Inst>::iterator it2);
+     void setSlice(vector<bool> *s) { slice = s; }
+     void setHandlers(map<int, int> *h) { handlers = h; }
+     int nsummaries();
      int symexec();
      ADDR32 conexec(Value *f, map<Value*, ADDR32> *input);
      void outputFormula(string reg);
@@ -62,6 +76,8 @@ public:
      void printAllMemFormulas();
      void printInputSymbols(string output);
      Value *getValue(string s) { return ctx[s]; }
+     const map<Value*, string> &getRegInput() { return reginput; }
+     const map<Value*, AddrRange> &getMemInput() { return meminput; }
      vector<Value*> getAllOutput();
      void showMemInput();
      void printMemFormula(ADDR32 addr1, ADDR32 addr2);
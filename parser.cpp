@@ -8,6 +8,7 @@
 #include <vector>
 #include <set>
 #include <regex>
+#include <climits>
 
 using namespace std;
 
@@ -169,13 +170,24 @@ void parseOperand(list<Inst>::iterator begin, list<Inst>::iterator end)
 
 // parse the whole trace into a instruction list L
 void parseTrace(ifstream *infile, list<Inst> *L)
+{
+     parseTrace(infile, L, 1, INT_MAX);
+}
+
+// parse only the instructions with ids in [first, last], a view of a
+// snippet in the trace. The instructions keep their ids in the trace.
+void parseTrace(ifstream *infile, list<Inst> *L, int first, int last)
 {
      string line;
      int num = 1;
 
-     while (infile->good()) {
+     while (infile->good() && num <= last) {
           getline(*infile, line);
           if (line.empty()) { continue; }
+          if (num < first) {
+               ++num;
+               continue;
+          }
 
           istringstream strbuf(line);
           string temp, disasstr;
@@ -0,0 +1,1033 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+
+using namespace std;
+
+#include "core.hpp"
+#include "parser.hpp"
+#include "slice.hpp"
+
+// instructions which have no data dependendency effect
+set<string> skipinst = {"test","jmp","jz","jbe","jo","jno","js","jns","je","jne",
+                            "jnz","jb","jnae","jc","jnb","jae",
+                            "jnc","jna","ja","jnbe","jl",
+                            "jnge","jge","jnl","jle","jng","jg",
+                            "jnle","jp","jpe","jnp","jpo","jcxz",
+                            "jecxz", "ret", "cmp", "call"};
+
+int buildParameter(list<Inst> &L)
+{
+     return buildParameter(L.begin(), L.end());
+}
+
+int buildParameter(list<Inst>::iterator begin, list<Inst>::iterator end)
+{
+     for (list<Inst>::iterator it = begin; it != end; ++it) {
+          if (skipinst.find(it->opcstr) != skipinst.end()) continue;
+
+          switch (it->oprnum) {
+          case 0:
+               break;
+          case 1:
+          {
+               Operand *op0 = it->oprd[0];
+               int nbyte;
+
+               if (it->opcstr == "push") {
+                    if (op0->ty == Operand::IMM) {
+                         it->addsrc(Parameter::IMM, op0->field[0]);
+                         AddrRange ar(it->waddr, it->waddr+3);
+                         it->adddst(Parameter::MEM, ar);
+                    } else if (op0->ty == Operand::REG) {
+                         it->addsrc(Parameter::REG, op0->field[0]);
+                         nbyte = op0->bit / 8;
+                         AddrRange ar(it->waddr, it->waddr + nbyte - 1);
+                         it->adddst(Parameter::MEM, ar);
+                    } else if (op0->ty == Operand::MEM) {
+                         nbyte = op0->bit / 8;
+                         AddrRange rar(it->raddr, it->raddr + nbyte - 1);
+                         it->addsrc(Parameter::MEM, rar);
+                         AddrRange war(it->waddr, it->waddr + nbyte - 1);
+                         it->adddst(Parameter::MEM, war);
+                    } else {
+                         cout << "push error: the operand is not Imm, Reg or Mem!" << endl;
+                         return 1;
+                    }
+               } else if (it->opcstr == "pop") {
+                    if (op0->ty == Operand::REG) {
+                         nbyte = op0->bit / 8;
+                         AddrRange rar(it->raddr, it->raddr + nbyte - 1);
+                         it->addsrc(Parameter::MEM, rar);
+                         it->adddst(Parameter::REG, op0->field[0]);
+                    } else if (op0->ty == Operand::MEM) {
+                         nbyte = op0->bit / 8;
+                         AddrRange rar(it->raddr, it->raddr + nbyte - 1);
+                         it->addsrc(Parameter::MEM, rar);
+                         AddrRange war(it->waddr, it->waddr + nbyte - 1);
+                         it->adddst(Parameter::MEM, war);
+                    } else {
+                         cout << "pop error: the operand is not Reg!" << endl;
+                         return 1;
+                    }
+               } else {
+                    if (op0->ty == Operand::REG) {
+                         it->addsrc(Parameter::REG, op0->field[0]);
+                         it->adddst(Parameter::REG, op0->field[0]);
+                    } else if (op0->ty == Operand::MEM) {
+                         nbyte = op0->bit / 8;
+                         AddrRange rar(it->raddr, it->raddr + nbyte - 1);
+                         it->addsrc(Parameter::MEM, rar);
+                         AddrRange war(it->waddr, it->waddr + nbyte - 1);
+                         it->adddst(Parameter::MEM, war);
+                    } else {
+                         cout << "[Error] Line " << it->id << ": Unknown 1 op instruction!"  << endl;
+                         return 1;
+
+                    }
+               }
+               break;
+          }
+          case 2:
+          {
+               Operand *op0 = it->oprd[0];
+               Operand *op1 = it->oprd[1];
+               int nbyte;
+
+               if (it->opcstr == "mov" || it->opcstr == "movzx") {
+                    if (op0->ty == Operand::REG) {
+                         if (op1->ty == Operand::IMM) {
+                              it->addsrc(Parameter::IMM, op1->field[0]);
+                              it->adddst(Parameter::REG, op0->field[0]);
+                         } else if (op1->ty == Operand::REG) {
+                              it->addsrc(Parameter::REG, op1->field[0]);
+                              it->adddst(Parameter::REG, op0->field[0]);
+                         } else if (op1->ty == Operand::MEM) {
+                              nbyte = op1->bit / 8;
+                              AddrRange rar(it->raddr, it->raddr + nbyte - 1);
+                              it->addsrc(Parameter::MEM, rar);
+                              it->adddst(Parameter::REG, op0->field[0]);
+                         } else {
+                              cout << "mov error: op0 is Reg, ";
+                              cout << "op1 is not ImmValue, Reg or Mem" << endl;
+                              return 1;
+                         }
+                    } else if (op0->ty == Operand::MEM) {
+                         if (op1->ty == Operand::IMM) {
+                              it->addsrc(Parameter::IMM, op1->field[0]);
+                              nbyte = op0->bit / 8;
+                              AddrRange war(it->waddr, it->waddr + nbyte - 1);
+                              it->adddst(Parameter::MEM, war);
+                         } else if (op1->ty == Operand::REG) {
+                              it->addsrc(Parameter::REG, op1->field[0]);
+                              nbyte = op0->bit / 8;
+                              AddrRange war(it->waddr, it->waddr + nbyte - 1);
+                              it->adddst(Parameter::MEM, war);
+                         } else {
+                              cout << "mov error: op0 is Mem, ";
+                              cout << "op1 is not ImmValue, Reg or Mem" << endl;
+                              return 1;
+                         }
+                    } else {
+                         cout << "mov error: op0 is not Mem or Reg." << endl;
+                         return 1;
+                    }
+               } else if (it->opcstr == "lea") {
+                    if (op0->ty != Operand::REG || op1->ty != Operand::MEM) {
+                         cout << "lea format error!" << endl;
+                    }
+                    switch (op1->tag) {
+                    case 5:
+                    {
+                         it->addsrc(Parameter::REG, op1->field[0]);
+                         it->addsrc(Parameter::REG, op1->field[1]);
+                         it->adddst(Parameter::REG, op0->field[0]);
+                         break;
+                    }
+                    default:
+                         cerr << "lea error: Other tags in addr are not ready." << endl;
+                         break;
+                    }
+               } else if (it->opcstr == "xchg") {
+                    if (op1->ty == Operand::REG) {
+                         it->addsrc(Parameter::REG, op1->field[0]);
+                         it->adddst2(Parameter::REG, op1->field[0]);
+                    } else if (op1->ty == Operand::MEM) {
+                         nbyte = op1->bit / 8;
+                         AddrRange ar(it->raddr, it->raddr + nbyte - 1);
+                         it->addsrc(Parameter::MEM, ar);
+                         it->adddst2(Parameter::MEM, ar);
+                    } else {
+                         cout << "xchg error: op1 is not Reg or Mem." << endl;
+                         return 1;
+                    }
+
+                    if (op0->ty == Operand::REG) {
+                         it->addsrc2(Parameter::REG, op0->field[0]);
+                         it->adddst(Parameter::REG, op0->field[0]);
+                    } else if (op0->ty == Operand::MEM) {
+                         nbyte = op0->bit / 8;
+                         AddrRange ar(it->raddr, it->raddr + nbyte - 1);
+                         it->addsrc2(Parameter::MEM, ar);
+                         it->adddst(Parameter::MEM, ar);
+                    } else {
+                         cout << "xchg error: op0 is not Reg or Mem." << endl;
+                         return 1;
+                    }
+               } else {
+                    if (op1->ty == Operand::IMM) {
+                         it->addsrc(Parameter::IMM, op1->field[0]);
+                    } else if (op1->ty == Operand::REG) {
+                         it->addsrc(Parameter::REG, op1->field[0]);
+                    } else if (op1->ty == Operand::MEM) {
+                         nbyte = op1->bit / 8;
+                         AddrRange rar1(it->raddr, it->raddr + nbyte - 1);
+                         it->addsrc(Parameter::MEM, rar1);
+                    } else {
+                         cout << "other 2-op instruction error: op1 is not Imm, Reg or Mem." << endl;
+                         return 1;
+                    }
+
+                    if (op0->ty == Operand::REG) {
+                         it->addsrc(Parameter::REG, op0->field[0]);
+                         it->adddst(Parameter::REG, op0->field[0]);
+                    } else if (op0->ty == Operand::MEM) {
+                         nbyte = op0->bit / 8;
+                         AddrRange rar2(it->raddr, it->raddr + nbyte - 1);
+                         it->addsrc(Parameter::MEM, rar2);
+                         it->adddst(Parameter::MEM, rar2);
+                    } else {
+                         cout << "other 2-op instruction erro: op0 is not Reg or Mem." << endl;
+                         return 1;
+                    }
+               }
+               break;
+          }
+          case 3:
+          {
+               Operand *op0 = it->oprd[0];
+               Operand *op1 = it->oprd[1];
+               Operand *op2 = it->oprd[2];
+
+               if (it->opcstr == "imul" && op0->ty == Operand::REG &&
+                   op1->ty == Operand::REG && op2->ty == Operand::IMM) { // imul reg, reg, imm
+                    it->addsrc(Parameter::IMM, op2->field[0]);
+                    it->addsrc(Parameter::REG, op1->field[0]);
+                    it->addsrc(Parameter::REG, op0->field[0]);
+               } else {
+                    cout << "other 3-op instruction error: ";
+                    cout << "Not imul reg, reg, imm." << endl;
+                    return 1;
+               }
+               break;
+          }
+          default:
+               cout << "error: instruction has more than 4 operands." << endl;
+               return 1;
+               break;
+          }
+     }
+
+     return 0;
+}
+
+void printInstParameter(list<Inst> &L)
+{
+     for (list<Inst>::iterator it = L.begin(); it != L.end(); ++it) {
+          cout << it->id << " " << it->addr << " " << it->assembly << "\t";
+          cout << "src: ";
+
+          for (int i = 0, max = it->src.size(); i < max; ++i) {
+               Parameter p = it->src[i];
+               if (p.ty == Parameter::IMM) {
+                    cout << "(IMM ";
+                    printf("0x%x) ", p.idx);
+               } else if (p.ty == Parameter::REG) {
+                    cout << "(REG ";
+                    cout << reg2string(p.reg) << p.idx << ") ";
+               } else if (p.ty == Parameter::MEM) {
+                    cout << "(MEM ";
+                    printf("%x) ", p.idx);
+               } else {
+                    cout << "printInstParameter error: unkonwn src type." << endl;
+               }
+          }
+          cout << ", dst: ";
+
+          for (int i = 0, max = it->dst.size(); i < max; ++i) {
+               Parameter p = it->dst[i];
+               if (p.ty == Parameter::IMM) {
+                    cout << "(IMM ";
+                    printf("0x%x) ", p.idx);
+               } else if (p.ty == Parameter::REG) {
+                    cout << "(REG ";
+                    cout << reg2string(p.reg) << p.idx << ") ";
+               } else if (p.ty == Parameter::MEM) {
+                    cout << "(MEM ";
+                    printf("%x) ", p.idx);
+               } else {
+                    cout << "printInstParameter error: unkonwn dst type." << endl;
+               }
+          }
+          cout << endl;
+     }
+}
+
+
+// write the ids of the instructions in sl, one per line
+void printSliceIds(list<Inst> &sl, string fname)
+{
+     FILE *ofp = fopen(fname.c_str(), "w");
+     for (list<Inst>::iterator it = sl.begin(); it != sl.end(); ++it) {
+          fprintf(ofp, "%d\n", it->id);
+     }
+     fclose(ofp);
+}
+
+// Walk backwards from the instruction last to begin, moving the live set wl
+// across each instruction. The live set is a ShadowState, so the dependency
+// test of each instruction costs one bit test per dst byte. Every instruction
+// is handled as the two data flows dst <- src and dst2 <- src2; only xchg has
+// the second one. Dependent instructions are appended to sl in reverse order.
+static void sliceback(list<Inst>::iterator begin, list<Inst>::iterator last,
+                      ShadowState *wl, vector<list<Inst>::iterator> *sl)
+{
+     list<Inst>::iterator it = last;
+     while (true) {
+          bool isdep1 = false, isdep2 = false;          // the current instruction is dependent or not
+
+          for (int i = 0, max = it->dst.size(); i < max; ++i) {
+               if (wl->test(it->dst[i])) {
+                    isdep1 = true;
+                    wl->reset(it->dst[i]);
+               }
+          }
+          for (int i = 0, max = it->dst2.size(); i < max; ++i) {
+               if (wl->test(it->dst2[i])) {
+                    isdep2 = true;
+                    wl->reset(it->dst2[i]);
+               }
+          }
+          if (isdep1) {
+               for (int i = 0, max = it->src.size(); i < max; ++i) {
+                    wl->set(it->src[i]);
+               }
+          }
+          if (isdep2) {
+               for (int i = 0, max = it->src2.size(); i < max; ++i) {
+                    wl->set(it->src2[i]);
+               }
+          }
+          if (isdep1 || isdep2)
+               sl->push_back(it);
+
+          if (it == begin) break;
+          --it;
+     }
+}
+
+// Backward slice from the source parameters of the last instruction in L.
+int backslice(list<Inst> &L)
+{
+     ShadowState wl;            // a working list containing current src parameters
+     vector<list<Inst>::iterator> rsl;
+     list<Inst> sl;             // the sliced result
+
+     list<Inst>::iterator last = prev(L.end());
+     for (int i = 0, max = last->src.size(); i < max; ++i) {
+          wl.set(last->src[i]);
+     }
+     sl.push_front(*last);
+     if (last != L.begin())
+          sliceback(L.begin(), prev(last), &wl, &rsl);
+     for (int i = 0, max = rsl.size(); i < max; ++i) {
+          sl.push_front(*rsl[i]);
+     }
+
+     wl.show();
+     cout << endl;
+     printInstParameter(sl);
+     printTraceHuman(sl, "slice.human.trace");
+     printTraceLLSE(sl, "slice.llse.trace");
+     printSliceIds(sl, "slice.ids");
+
+     return 0;
+}
+
+// Backward slice of the value of loc right after the last instruction of
+// [begin, end). The slice is stored in sl in trace order.
+void sliceRange(list<Inst>::iterator begin, list<Inst>::iterator end,
+                vector<Parameter> &loc, vector<list<Inst>::iterator> *sl)
+{
+     ShadowState wl;
+
+     sl->clear();
+     if (begin == end) return;
+     for (int i = 0, max = loc.size(); i < max; ++i) {
+          wl.set(loc[i]);
+     }
+     sliceback(begin, prev(end), &wl, sl);
+     reverse(sl->begin(), sl->end());
+}
+
+// Transfer summary of one chunk of the trace for parslice. A node is one
+// data flow of an instruction, pos * 2 + 0 for dst <- src and pos * 2 + 1
+// for dst2 <- src2. For every node of the chunk, the summary keeps the nodes
+// inside the chunk its src bytes depend on, and the src bytes read before
+// any write in the chunk. lastw maps every byte written in the chunk to its
+// last writer node + 1.
+struct ChunkSummary {
+     uint32_t begin, end;               // positions [begin, end)
+     ShadowMap<uint32_t> lastw;
+     vector<uint32_t> edgeoff;          // per node (node - begin * 2)
+     vector<uint32_t> edges;
+     vector<uint32_t> inoff;
+     vector<Parameter> inputs;
+};
+
+void summarizeChunk(vector<list<Inst>::iterator> *idx, ChunkSummary *cs)
+{
+     for (uint32_t pos = cs->begin; pos < cs->end; ++pos) {
+          list<Inst>::iterator it = (*idx)[pos];
+
+          for (int flow = 0; flow < 2; ++flow) {
+               vector<Parameter> &src = flow == 0 ? it->src : it->src2;
+               size_t first = cs->edges.size();
+               cs->edgeoff.push_back(first);
+               cs->inoff.push_back(cs->inputs.size());
+               for (int i = 0, max = src.size(); i < max; ++i) {
+                    if (src[i].isIMM()) continue;
+                    uint32_t w = cs->lastw.get(src[i]);
+                    if (w != 0)
+                         cs->edges.push_back(w - 1);
+                    else
+                         cs->inputs.push_back(src[i]);
+               }
+               sort(cs->edges.begin() + first, cs->edges.end());
+               cs->edges.erase(unique(cs->edges.begin() + first, cs->edges.end()), cs->edges.end());
+          }
+
+          for (int i = 0, max = it->dst.size(); i < max; ++i) {
+               cs->lastw.ref(it->dst[i]) = pos * 2 + 1;
+          }
+          for (int i = 0, max = it->dst2.size(); i < max; ++i) {
+               cs->lastw.ref(it->dst2[i]) = pos * 2 + 2;
+          }
+     }
+     cs->edgeoff.push_back(cs->edges.size());
+     cs->inoff.push_back(cs->inputs.size());
+}
+
+// The same slice as backslice, computed by nthread threads. The trace is
+// split into one chunk per thread and the chunk summaries are built in
+// parallel. The live set is then carried across chunk boundaries from the
+// end of the trace. In each chunk only the nodes reached from its live-out
+// set are visited, so this sequential part is proportional to the slice.
+int parslice(list<Inst> &L, int nthread)
+{
+     vector<list<Inst>::iterator> idx;
+     for (list<Inst>::iterator it = L.begin(); it != L.end(); ++it) {
+          idx.push_back(it);
+     }
+     uint32_t n = idx.size();
+     if (n == 0)
+          return 1;
+     if (nthread < 1)
+          nthread = 1;
+     if ((uint32_t)nthread > n)
+          nthread = n;
+
+     ChunkSummary *chunks = new ChunkSummary[nthread];
+     vector<thread> workers;
+     for (int c = 0; c < nthread; ++c) {
+          chunks[c].begin = (uint64_t)n * c / nthread;
+          chunks[c].end = (uint64_t)n * (c + 1) / nthread;
+          workers.push_back(thread(summarizeChunk, &idx, &chunks[c]));
+     }
+     for (int c = 0; c < nthread; ++c) {
+          workers[c].join();
+     }
+
+     vector<bool> visited(n * 2, false);
+     vector<Parameter> live;
+     vector<uint32_t> stk(1, (n - 1) * 2);      // the src flow of the last instruction
+     visited[stk[0]] = true;
+
+     for (int c = nthread - 1; c >= 0; --c) {
+          ChunkSummary *cs = &chunks[c];
+          ShadowState inset;
+          vector<Parameter> livein;
+
+          for (int i = 0, max = live.size(); i < max; ++i) {
+               uint32_t w = cs->lastw.get(live[i]);
+               if (w == 0) {
+                    if (!inset.test(live[i])) {
+                         inset.set(live[i]);
+                         livein.push_back(live[i]);
+                    }
+               } else if (!visited[w - 1]) {
+                    visited[w - 1] = true;
+                    stk.push_back(w - 1);
+               }
+          }
+
+          while (!stk.empty()) {
+               uint32_t node = stk.back();
+               uint32_t k = node - cs->begin * 2;
+               stk.pop_back();
+
+               for (uint32_t i = cs->edgeoff[k]; i < cs->edgeoff[k + 1]; ++i) {
+                    if (!visited[cs->edges[i]]) {
+                         visited[cs->edges[i]] = true;
+                         stk.push_back(cs->edges[i]);
+                    }
+               }
+               for (uint32_t i = cs->inoff[k]; i < cs->inoff[k + 1]; ++i) {
+                    if (!inset.test(cs->inputs[i])) {
+                         inset.set(cs->inputs[i]);
+                         livein.push_back(cs->inputs[i]);
+                    }
+               }
+          }
+          live.swap(livein);
+     }
+     delete[] chunks;
+
+     ShadowState wl;
+     list<Inst> sl;
+     for (int i = 0, max = live.size(); i < max; ++i) {
+          wl.set(live[i]);
+     }
+     for (uint32_t pos = 0; pos < n; ++pos) {
+          if (visited[pos * 2] || visited[pos * 2 + 1])
+               sl.push_back(*idx[pos]);
+     }
+
+     wl.show();
+     cout << endl;
+     printInstParameter(sl);
+     printTraceHuman(sl, "slice.human.trace");
+     printTraceLLSE(sl, "slice.llse.trace");
+     printSliceIds(sl, "slice.ids");
+
+     return 0;
+}
+
+// read slicing criteria or taint sources from fname, one "<id> <location>" per line
+int readCriteria(string fname, vector<Criterion> *C)
+{
+     ifstream infile(fname);
+     if (!infile.is_open()) {
+          fprintf(stderr, "Open criteria file error!\n");
+          return 1;
+     }
+
+     string line;
+     while (getline(infile, line)) {
+          istringstream strbuf(line);
+          Criterion c;
+          if (!(strbuf >> c.id >> c.locstr)) continue;
+          if (parseLocation(c.locstr, &c.loc) != 0) {
+               fprintf(stderr, "Unknown location in criteria: %s\n", c.locstr.c_str());
+               return 1;
+          }
+          C->push_back(c);
+     }
+
+     return 0;
+}
+
+// Backward slice for all criteria in C in one reverse pass. Every live byte
+// carries a mask with one bit per criterion, so an instruction belongs to the
+// slices of all criteria whose bits reach one of its dst bytes. One slice per
+// criterion and a membership matrix of all sliced instructions are written.
+int multislice(list<Inst> &L, vector<Criterion> &C)
+{
+     typedef uint64_t CritSet;
+     const int maxcrit = 64;
+
+     int n = C.size();
+     if (n == 0 || n > maxcrit) {
+          fprintf(stderr, "multislice: need 1 to %d criteria, got %d\n", maxcrit, n);
+          return 1;
+     }
+
+     // visit criteria in reverse trace order
+     vector<int> order(n);
+     for (int i = 0; i < n; ++i) order[i] = i;
+     sort(order.begin(), order.end(), [&C](int a, int b) { return C[a].id > C[b].id; });
+
+     ShadowMap<CritSet> wl;      // criteria of each live parameter
+     vector<pair<list<Inst>::iterator, CritSet> > members;  // in reverse order
+     int k = 0;
+
+     for (list<Inst>::reverse_iterator rit = L.rbegin(); rit != L.rend(); ++rit) {
+          for (; k < n && C[order[k]].id >= rit->id; ++k) {
+               CritSet bit = (CritSet)1 << order[k];
+               vector<Parameter> &loc = C[order[k]].loc;
+               for (int i = 0, max = loc.size(); i < max; ++i) {
+                    wl.ref(loc[i]) |= bit;
+               }
+          }
+
+          if (rit->dst.size() == 0 && rit->dst2.size() == 0) continue;
+
+          CritSet dep1 = 0, dep2 = 0;
+          for (int i = 0, max = rit->dst.size(); i < max; ++i) {
+               CritSet c = wl.get(rit->dst[i]);
+               if (c) {
+                    dep1 |= c;
+                    wl.ref(rit->dst[i]) = 0;
+               }
+          }
+          for (int i = 0, max = rit->dst2.size(); i < max; ++i) {
+               CritSet c = wl.get(rit->dst2[i]);
+               if (c) {
+                    dep2 |= c;
+                    wl.ref(rit->dst2[i]) = 0;
+               }
+          }
+          if (dep1) {
+               for (int i = 0, max = rit->src.size(); i < max; ++i) {
+                    if (!rit->src[i].isIMM())
+                         wl.ref(rit->src[i]) |= dep1;
+               }
+          }
+          if (dep2) {
+               for (int i = 0, max = rit->src2.size(); i < max; ++i) {
+                    if (!rit->src2[i].isIMM())
+                         wl.ref(rit->src2[i]) |= dep2;
+               }
+          }
+          if (dep1 | dep2)
+               members.push_back(make_pair(prev(rit.base()), dep1 | dep2));
+     }
+
+     FILE *fp = fopen("slice.matrix.txt", "w");
+     for (int i = members.size() - 1; i >= 0; --i) {
+          list<Inst>::iterator it = members[i].first;
+          fprintf(fp, "%d %s ", it->id, it->addr.c_str());
+          for (int j = 0; j < n; ++j) {
+               fputc((members[i].second >> j) & 1 ? '1' : '0', fp);
+          }
+          fprintf(fp, "\t%s\n", it->assembly.c_str());
+     }
+     fclose(fp);
+
+     for (int j = 0; j < n; ++j) {
+          list<Inst> sl;
+          for (int i = members.size() - 1; i >= 0; --i) {
+               if ((members[i].second >> j) & 1)
+                    sl.push_back(*members[i].first);
+          }
+          cout << "criterion " << j + 1 << ": " << C[j].id << " " << C[j].locstr;
+          cout << ", " << sl.size() << " instructions" << endl;
+          printTraceHuman(sl, "slice." + to_string(j + 1) + ".human.trace");
+          printTraceLLSE(sl, "slice." + to_string(j + 1) + ".llse.trace");
+     }
+
+     return 0;
+}
+
+// read locations from fname, separated by white space
+int readLocations(string fname, vector<Parameter> *loc)
+{
+     ifstream infile(fname);
+     if (!infile.is_open()) {
+          fprintf(stderr, "Open location file error!\n");
+          return 1;
+     }
+
+     string s;
+     while (infile >> s) {
+          if (parseLocation(s, loc) != 0) {
+               fprintf(stderr, "Unknown location: %s\n", s.c_str());
+               return 1;
+          }
+     }
+
+     return 0;
+}
+
+// Dead code elimination over L with the locations in liveout live after its
+// last instruction. A backward pass moves the live set across every
+// instruction like the slicer does; an instruction is kept if it writes a
+// live byte, or if it writes nothing at all, like a jump or compare, whose
+// effect on control flow stays. The srcs of kept instructions become live.
+int deadcode(list<Inst> &L, vector<Parameter> &liveout)
+{
+     ShadowState live;
+     list<Inst> kl;             // the kept instructions
+
+     for (int i = 0, max = liveout.size(); i < max; ++i) {
+          live.set(liveout[i]);
+     }
+
+     for (list<Inst>::reverse_iterator it = L.rbegin(); it != L.rend(); ++it) {
+          bool keep1 = it->dst.empty() && it->dst2.empty();
+          bool keep2 = false;
+          for (int i = 0, max = it->dst.size(); i < max; ++i) {
+               if (live.test(it->dst[i])) {
+                    keep1 = true;
+                    live.reset(it->dst[i]);
+               }
+          }
+          for (int i = 0, max = it->dst2.size(); i < max; ++i) {
+               if (live.test(it->dst2[i])) {
+                    keep2 = true;
+                    live.reset(it->dst2[i]);
+               }
+          }
+          if (keep1) {
+               for (int i = 0, max = it->src.size(); i < max; ++i) {
+                    live.set(it->src[i]);
+               }
+          }
+          if (keep2) {
+               for (int i = 0, max = it->src2.size(); i < max; ++i) {
+                    live.set(it->src2[i]);
+               }
+          }
+          if (keep1 || keep2)
+               kl.push_front(*it);
+     }
+
+     cout << kl.size() << " of " << L.size() << " instructions kept" << endl;
+     cout << "live inputs: ";
+     live.show();
+     cout << endl;
+     printTraceHuman(kl, "dce.human.trace");
+     printTraceLLSE(kl, "dce.llse.trace");
+     printSliceIds(kl, "dce.ids");
+
+     return 0;
+}
+
+// Forward taint propagation from the sources in T, in one pass over L. A
+// source taints its location right before instruction id executes. A dst
+// becomes tainted when one of its src parameters is tainted and is cleaned
+// otherwise. All touched instructions and the tainted locations at the end
+// of the trace are written.
+int forwardtaint(list<Inst> &L, vector<Criterion> &T)
+{
+     int n = T.size();
+     vector<int> order(n);
+     for (int i = 0; i < n; ++i) order[i] = i;
+     sort(order.begin(), order.end(), [&T](int a, int b) { return T[a].id < T[b].id; });
+
+     ShadowState ts;            // tainted parameters
+     list<Inst> tl;             // the touched instructions
+     int k = 0;
+
+     for (list<Inst>::iterator it = L.begin(); it != L.end(); ++it) {
+          for (; k < n && T[order[k]].id <= it->id; ++k) {
+               vector<Parameter> &loc = T[order[k]].loc;
+               for (int i = 0, max = loc.size(); i < max; ++i) {
+                    ts.set(loc[i]);
+               }
+          }
+
+          if (it->dst.size() == 0 && it->dst2.size() == 0) continue;
+
+          bool istaint1 = false, istaint2 = false;
+          for (int i = 0, max = it->src.size(); i < max && !istaint1; ++i) {
+               istaint1 = ts.test(it->src[i]);
+          }
+          for (int i = 0, max = it->src2.size(); i < max && !istaint2; ++i) {
+               istaint2 = ts.test(it->src2[i]);
+          }
+          for (int i = 0, max = it->dst.size(); i < max; ++i) {
+               if (istaint1)
+                    ts.set(it->dst[i]);
+               else
+                    ts.reset(it->dst[i]);
+          }
+          for (int i = 0, max = it->dst2.size(); i < max; ++i) {
+               if (istaint2)
+                    ts.set(it->dst2[i]);
+               else
+                    ts.reset(it->dst2[i]);
+          }
+          if (istaint1 || istaint2)
+               tl.push_back(*it);
+     }
+
+     cout << tl.size() << " tainted instructions" << endl;
+     cout << "tainted outputs: ";
+     ts.show();
+     cout << endl;
+     printTraceHuman(tl, "taint.human.trace");
+     printTraceLLSE(tl, "taint.llse.trace");
+
+     return 0;
+}
+
+
+DDGraph::~DDGraph()
+{
+     if (map != NULL)
+          munmap(map, maplen);
+}
+
+static const char ddgmagic[8] = {'V','M','H','D','D','G','2','\n'};
+
+// one pass over L recording the last writer node of every src byte
+void buildDDG(list<Inst> &L, DDGraph *g)
+{
+     ShadowMap<uint32_t> lastw;   // node + 1 of the last writer, 0 if none
+     vector<uint32_t> writers;
+     uint32_t pos = 0;
+
+     g->firstid = L.empty() ? 0 : L.front().id;
+     g->offsetbuf.clear();
+     g->edgebuf.clear();
+
+     for (list<Inst>::iterator it = L.begin(); it != L.end(); ++it, ++pos) {
+          for (int flow = 0; flow < 2; ++flow) {
+               vector<Parameter> &src = flow == 0 ? it->src : it->src2;
+               g->offsetbuf.push_back(g->edgebuf.size());
+
+               writers.clear();
+               for (int i = 0, max = src.size(); i < max; ++i) {
+                    if (src[i].isIMM()) continue;
+                    uint32_t w = lastw.get(src[i]);
+                    if (w != 0) writers.push_back(w - 1);
+               }
+               sort(writers.begin(), writers.end(), greater<uint32_t>());
+               writers.erase(unique(writers.begin(), writers.end()), writers.end());
+
+               uint32_t last = pos * 2 + flow;
+               for (int i = 0, max = writers.size(); i < max; ++i) {
+                    putVarint(&g->edgebuf, last - writers[i]);
+                    last = writers[i];
+               }
+          }
+
+          for (int i = 0, max = it->dst.size(); i < max; ++i) {
+               lastw.ref(it->dst[i]) = pos * 2 + 1;
+          }
+          for (int i = 0, max = it->dst2.size(); i < max; ++i) {
+               lastw.ref(it->dst2[i]) = pos * 2 + 2;
+          }
+     }
+     g->offsetbuf.push_back(g->edgebuf.size());
+
+     g->ninst = pos;
+     g->offset = g->offsetbuf.data();
+     g->edges = g->edgebuf.data();
+}
+
+int writeDDG(DDGraph *g, string fname)
+{
+     FILE *fp = fopen(fname.c_str(), "wb");
+     if (fp == NULL) {
+          fprintf(stderr, "Open ddg file error!\n");
+          return 1;
+     }
+     fwrite(ddgmagic, 1, sizeof(ddgmagic), fp);
+     fwrite(&g->ninst, sizeof(g->ninst), 1, fp);
+     fwrite(&g->firstid, sizeof(g->firstid), 1, fp);
+     fwrite(g->offset, sizeof(uint64_t), (uint64_t)g->ninst * 2 + 1, fp);
+     fwrite(g->edges, 1, g->offset[(uint64_t)g->ninst * 2], fp);
+     fclose(fp);
+
+     return 0;
+}
+
+// Map a graph written by writeDDG. The header, the offset table and the
+// edge stream are checked against the file size, so a truncated or foreign
+// file is rejected instead of read past its end.
+int mapDDG(string fname, DDGraph *g)
+{
+     int fd = open(fname.c_str(), O_RDONLY);
+     if (fd < 0) {
+          fprintf(stderr, "Open ddg file error!\n");
+          return 1;
+     }
+     struct stat st;
+     if (fstat(fd, &st) != 0) {
+          fprintf(stderr, "Stat ddg file error!\n");
+          close(fd);
+          return 1;
+     }
+     size_t len = st.st_size;
+     void *p = len < 16 ? MAP_FAILED : mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+     close(fd);
+     if (p == MAP_FAILED || memcmp(p, ddgmagic, sizeof(ddgmagic)) != 0) {
+          fprintf(stderr, "%s is not a ddg file!\n", fname.c_str());
+          if (p != MAP_FAILED) munmap(p, len);
+          return 1;
+     }
+
+     const char *base = (const char *)p;
+     uint32_t ninst;
+     memcpy(&ninst, base + 8, sizeof(ninst));
+     uint64_t nnode = (uint64_t)ninst * 2;
+     uint64_t edgestart = 16 + (nnode + 1) * sizeof(uint64_t);
+     const uint64_t *offset = (const uint64_t *)(base + 16);
+     bool valid = edgestart <= len && offset[0] == 0 && offset[nnode] == len - edgestart;
+     for (uint64_t i = 0; valid && i < nnode; ++i) {
+          valid = offset[i] <= offset[i + 1];
+     }
+     // the last varint of the stream must end in the file
+     if (valid && len > edgestart)
+          valid = (base[len - 1] & 0x80) == 0;
+     if (!valid) {
+          fprintf(stderr, "%s is truncated or corrupt!\n", fname.c_str());
+          munmap(p, len);
+          return 1;
+     }
+
+     g->ninst = ninst;
+     memcpy(&g->firstid, base + 12, sizeof(g->firstid));
+     g->offset = offset;
+     g->edges = (const uint8_t *)(base + edgestart);
+     g->map = p;
+     g->maplen = len;
+
+     return 0;
+}
+
+// Backward slice over the graph from the nodes seeds and the writers of
+// their src bytes. Only the nodes in the slice are visited. Return the
+// positions of the instructions in the slice in ascending order.
+vector<uint32_t> ddgslice(DDGraph *g, vector<uint32_t> &seeds)
+{
+     uint32_t nnode = g->ninst * 2;
+     vector<bool> visited(nnode, false);
+     vector<uint32_t> stk, sl;
+
+     for (int i = 0, max = seeds.size(); i < max; ++i) {
+          if (seeds[i] < nnode && !visited[seeds[i]]) {
+               visited[seeds[i]] = true;
+               stk.push_back(seeds[i]);
+          }
+     }
+
+     while (!stk.empty()) {
+          uint32_t node = stk.back();
+          stk.pop_back();
+          sl.push_back(node / 2);
+
+          const uint8_t *p = g->edges + g->offset[node];
+          const uint8_t *e = g->edges + g->offset[node + 1];
+          uint32_t w = node;
+          while (p < e) {
+               uint64_t delta;
+               p = getVarint(p, &delta);
+               if (delta == 0 || delta > w) {
+                    cerr << "ddgslice: bad edge of node " << node << endl;
+                    break;
+               }
+               w -= delta;
+               if (!visited[w]) {
+                    visited[w] = true;
+                    stk.push_back(w);
+               }
+          }
+     }
+     sort(sl.begin(), sl.end());
+     sl.erase(unique(sl.begin(), sl.end()), sl.end());
+
+     return sl;
+}
+
+// Backward slice over the graph from the src bytes of the instruction with
+// the given id.
+vector<uint32_t> ddgslice(DDGraph *g, int id)
+{
+     vector<uint32_t> seeds;
+     if (id < g->firstid || (uint32_t)(id - g->firstid) >= g->ninst) {
+          cerr << "ddgslice: no instruction " << id << endl;
+          return seeds;
+     }
+     seeds.push_back((id - g->firstid) * 2);
+
+     return ddgslice(g, seeds);
+}
+
+// Graph nodes of the last writers of the bytes in loc, seen right after the
+// instruction at position pos (pointed to by it) executes. Scan backwards
+// until every byte has been found or the trace begins.
+vector<uint32_t> findWriters(list<Inst> &L, list<Inst>::iterator it, uint32_t pos,
+                             vector<Parameter> &loc)
+{
+     ShadowState pending;
+     vector<uint32_t> writers;
+
+     for (int i = 0, max = loc.size(); i < max; ++i) {
+          pending.set(loc[i]);
+     }
+
+     while (!pending.empty()) {
+          bool iswriter1 = false, iswriter2 = false;
+          for (int i = 0, max = it->dst.size(); i < max; ++i) {
+               if (pending.test(it->dst[i])) {
+                    iswriter1 = true;
+                    pending.reset(it->dst[i]);
+               }
+          }
+          for (int i = 0, max = it->dst2.size(); i < max; ++i) {
+               if (pending.test(it->dst2[i])) {
+                    iswriter2 = true;
+                    pending.reset(it->dst2[i]);
+               }
+          }
+          if (iswriter1)
+               writers.push_back(pos * 2);
+          if (iswriter2)
+               writers.push_back(pos * 2 + 1);
+          if (it == L.begin())
+               break;
+          --it;
+          --pos;
+     }
+
+     return writers;
+}
+
+// copy the trace lines of the slice positions to slice.llse.trace without
+// parsing the trace, and their ids to slice.ids
+int outputDDGSlice(DDGraph *g, vector<uint32_t> &sl, string tracefile)
+{
+     ifstream infile(tracefile);
+     if (!infile.is_open()) {
+          fprintf(stderr, "Open file error!\n");
+          return 1;
+     }
+     FILE *ofp = fopen("slice.llse.trace", "w");
+     FILE *idfp = fopen("slice.ids", "w");
+
+     string line;
+     int id = 0;
+     int i = 0, max = sl.size();
+     while (i < max && getline(infile, line)) {
+          if (line.empty()) continue;
+          if (++id >= g->firstid && (uint32_t)(id - g->firstid) == sl[i]) {
+               fprintf(ofp, "%s\n", line.c_str());
+               fprintf(idfp, "%d\n", g->firstid + (int)sl[i]);
+               ++i;
+          }
+     }
+     fclose(ofp);
+     fclose(idfp);
+
+     for (i = 0; i < max; ++i) {
+          cout << g->firstid + (int)sl[i] << " ";
+     }
+     cout << endl << max << " instructions in slice" << endl;
+
+     return 0;
+}
@@ -0,0 +1,50 @@
+// A slicing criterion: the value of loc right after instruction id executes
+struct Criterion {
+     int id;
+     string locstr;
+     vector<Parameter> loc;
+};
+
+// Dynamic dependence graph. Every instruction at position i of the trace has
+// two nodes, one per data flow: 2i for dst <- src and 2i + 1 for dst2 <- src2
+// (only xchg has the second one). The edges of a node are the nodes that last
+// wrote its src bytes, sorted in descending order and stored as varint
+// deltas: n - w0, w0 - w1, ... The file layout is a 16 byte header (magic,
+// ninst, firstid), 2 * ninst + 1 uint64_t offsets into the edge stream, then
+// the edge stream itself, so a mapped file is used in place.
+struct DDGraph {
+     uint32_t ninst;
+     int32_t firstid;             // id of the instruction at position 0
+     const uint64_t *offset;
+     const uint8_t *edges;
+
+     vector<uint64_t> offsetbuf;  // storage of a graph built in memory
+     vector<uint8_t> edgebuf;
+     void *map;                   // storage of a graph mapped from a file
+     size_t maplen;
+
+     DDGraph() : ninst(0), firstid(0), offset(NULL), edges(NULL), map(NULL), maplen(0) {}
+     ~DDGraph();
+};
+
+int buildParameter(list<Inst> &L);
+int buildParameter(list<Inst>::iterator begin, list<Inst>::iterator end);
+void printInstParameter(list<Inst> &L);
+void printSliceIds(list<Inst> &sl, string fname);
+int readCriteria(string fname, vector<Criterion> *C);
+int backslice(list<Inst> &L);
+int parslice(list<Inst> &L, int nthread);
+void sliceRange(list<Inst>::iterator begin, list<Inst>::iterator end,
+                vector<Parameter> &loc, vector<list<Inst>::iterator> *sl);
+int multislice(list<Inst> &L, vector<Criterion> &C);
+int forwardtaint(list<Inst> &L, vector<Criterion> &T);
+int readLocations(string fname, vector<Parameter> *loc);
+int deadcode(list<Inst> &L, vector<Parameter> &liveout);
+void buildDDG(list<Inst> &L, DDGraph *g);
+int writeDDG(DDGraph *g, string fname);
+int mapDDG(string fname, DDGraph *g);
+vector<uint32_t> ddgslice(DDGraph *g, vector<uint32_t> &seeds);
+vector<uint32_t> ddgslice(DDGraph *g, int id);
+vector<uint32_t> findWriters(list<Inst> &L, list<Inst>::iterator it, uint32_t pos,
+                             vector<Parameter> &loc);
+int outputDDGSlice(DDGraph *g, vector<uint32_t> &sl, string tracefile);
@@ -0,0 +1,100 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <set>
+#include <cstdlib>
+
+using namespace std;
+
+#include "../core.hpp"
+#include "../parser.hpp"
+#include "../mg-symengine.hpp"
+
+// Check symbolic execution with handler summaries against full execution of
+// the trace. Input symbols are matched by register name and memory range,
+// and the formulas of the checked registers must agree on random concrete
+// values of them.
+
+ADDR32 eval(Value *v, map<Value*, ADDR32> *inmap);
+
+// random values of the input symbols of se, the same for the same register
+// or memory range in every engine of a round
+void assign(SEEngine *se, map<string, ADDR32> *regval, map<AddrRange, ADDR32> *memval,
+            map<Value*, ADDR32> *inmap)
+{
+     const map<Value*, string> &regs = se->getRegInput();
+     for (map<Value*, string>::const_iterator i = regs.begin(); i != regs.end(); ++i) {
+          if (regval->find(i->second) == regval->end())
+               (*regval)[i->second] = ((ADDR32)rand() << 16) ^ rand();
+          (*inmap)[i->first] = (*regval)[i->second];
+     }
+     const map<Value*, AddrRange> &mems = se->getMemInput();
+     for (map<Value*, AddrRange>::const_iterator i = mems.begin(); i != mems.end(); ++i) {
+          if (memval->find(i->second) == memval->end())
+               (*memval)[i->second] = ((ADDR32)rand() << 16) ^ rand();
+          (*inmap)[i->first] = (*memval)[i->second];
+     }
+}
+
+int main(int argc, char **argv) {
+     if (argc < 4) {
+          fprintf(stderr, "usage: %s <tracefile> <handlers> <reg>...\n", argv[0]);
+          return 1;
+     }
+
+     list<Inst> L;
+     ifstream infile(argv[1]);
+     if (!infile.is_open()) {
+          fprintf(stderr, "Open file error!\n");
+          return 1;
+     }
+     parseTrace(&infile, &L);
+     parseOperand(L.begin(), L.end());
+
+     // first-last words, as mgse -h reads them
+     map<int, int> handlers;
+     ifstream hfile(argv[2]);
+     string word;
+     while (hfile >> word) {
+          int first, last;
+          char dash;
+          istringstream strbuf(word);
+          if (strbuf >> first >> dash >> last && dash == '-' && first <= last)
+               handlers[first] = last;
+     }
+
+     SEEngine *full = new SEEngine(), *summed = new SEEngine();
+     full->initAllRegSymol(L.begin(), L.end());
+     summed->initAllRegSymol(L.begin(), L.end());
+     summed->setHandlers(&handlers);
+     full->symexec();
+     summed->symexec();
+     if (summed->nsummaries() == 0) {
+          printf("%s: no handler summaries\n", argv[1]);
+          return 1;
+     }
+
+     int bad = 0;
+     srand(1);
+     for (int round = 0; round < 64; ++round) {
+          map<string, ADDR32> regval;
+          map<AddrRange, ADDR32> memval;
+          map<Value*, ADDR32> fullmap, summedmap;
+          assign(full, &regval, &memval, &fullmap);
+          assign(summed, &regval, &memval, &summedmap);
+          for (int k = 3; k < argc; ++k) {
+               ADDR32 a = eval(full->getValue(argv[k]), &fullmap);
+               ADDR32 b = eval(summed->getValue(argv[k]), &summedmap);
+               if (a != b) {
+                    if (bad++ == 0)
+                         printf("%s: %s is %x executed in full but %x from summaries\n", argv[1], argv[k], a, b);
+               }
+          }
+     }
+
+     return bad != 0;
+}
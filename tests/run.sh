@@ -0,0 +1,149 @@
+#!/bin/sh
+# Regression checks, run by "make check" from the project root.
+
+fail=0
+check() {
+     if "$@"; then
+          echo "ok   $*"
+     else
+          echo "FAIL $*"
+          fail=1
+     fi
+}
+
+# sliced symbolic execution against the whole trace, with partial register
+# writes outside the slice
+check tests/slicese tests/partial1.txt tests/partial.ids eax ebx
+check tests/slicese tests/partial2.txt tests/partial.ids edx
+check tests/slicese tests/partial3.txt tests/partial.ids eax
+
+# symbolic execution with handler summaries against full execution, on a
+# handler repeated with its memory operands apart and aliased; mgse -h
+# prints the eax formula of mgse, up to the numbering of the symbols
+check tests/handlerse tests/alias.txt tests/alias.handlers eax ebx ecx
+symorder() {
+     awk '{ out = ""
+            while (match($0, /sym[0-9]+/)) {
+                 s = substr($0, RSTART, RLENGTH)
+                 if (!(s in n)) n[s] = k++
+                 out = out substr($0, 1, RSTART - 1) "sym" n[s]
+                 $0 = substr($0, RSTART + RLENGTH)
+            }
+            print out $0 }'
+}
+handlerse() {
+     dir=$(mktemp -d)
+     ./mgse tests/alias.txt 2> /dev/null | symorder > $dir/full.txt &&
+     ./mgse -h tests/alias.handlers tests/alias.txt 2> /dev/null | symorder > $dir/summed.txt &&
+     cmp -s $dir/full.txt $dir/summed.txt
+     r=$?
+     rm -rf $dir
+     return $r
+}
+check handlerse
+
+# parallel context switch search against one pass, on a trace of repeated
+# saves and restores long enough to be split
+ctxpar() {
+     dir=$(mktemp -d)
+     for i in $(seq 40); do cat tests/ctx.txt; done > $dir/trace.txt
+     (cd $dir && $OLDPWD/vmextract -j 1 "$@" trace.txt > out1.txt && mv vmsnippets.txt snip1.txt &&
+      $OLDPWD/vmextract -j 4 "$@" trace.txt > out4.txt && mv vmsnippets.txt snip4.txt &&
+      cmp -s out1.txt out4.txt && cmp -s snip1.txt snip4.txt)
+     r=$?
+     rm -rf $dir
+     return $r
+}
+check ctxpar
+check ctxpar -p $PWD/tests/ctx.rules
+
+# slices from a saved dependence graph and from vmserver against the
+# backward slice of the view ending at the same instruction, on a trace with
+# xchg and stack traffic
+ddgslice() {
+     dir=$(mktemp -d)
+     (cd $dir && $OLDPWD/slicer -g g.ddg $OLDPWD/tests/dep.txt > /dev/null &&
+      $OLDPWD/slicer -v 1-$1 $OLDPWD/tests/dep.txt > /dev/null && sort -n slice.ids > back.ids &&
+      $OLDPWD/slicer -q g.ddg -i $1 $OLDPWD/tests/dep.txt > /dev/null && sort -n slice.ids > ddg.ids &&
+      printf "slice $1\nquit\n" | $OLDPWD/vmserver $OLDPWD/tests/dep.txt |
+          awk 'NR > 2 && /^[0-9]/ { print $1 }' | sort -n > server.ids &&
+      cmp -s back.ids ddg.ids && cmp -s back.ids server.ids)
+     r=$?
+     rm -rf $dir
+     return $r
+}
+check ddgslice 100
+check ddgslice 151
+check ddgslice 217
+
+# the parallel slicer against the sequential one, with the trace split at
+# different points
+parslice() {
+     dir=$(mktemp -d)
+     (cd $dir && $OLDPWD/slicer "$@" > /dev/null && mv slice.ids seq.ids &&
+      $OLDPWD/slicer -j 4 "$@" > /dev/null && cmp -s seq.ids slice.ids &&
+      $OLDPWD/slicer -j 7 "$@" > /dev/null && cmp -s seq.ids slice.ids)
+     r=$?
+     rm -rf $dir
+     return $r
+}
+check parslice $PWD/tests/dep.txt
+check parslice -v 1-100 $PWD/tests/dep.txt
+check parslice -v 1-217 $PWD/tests/dep.txt
+check parslice $PWD/tests/partial1.txt
+check parslice $PWD/tests/partial2.txt
+
+# basic blocks of a trace that jumps into the middle of a block and then
+# runs through blocks split before: disjoint blocks split at every target
+cfgsplit() {
+     dir=$(mktemp -d)
+     (cd $dir && $OLDPWD/vmextract -c $OLDPWD/tests/cfg.txt > /dev/null &&
+      awk '/^BB[0-9]+:/ { print $2 $3 }' cfginfo.txt | sort > bbs.txt &&
+      printf "1000,1000,\n1001,1002,\n1003,1004,\n1005,1005,\n1006,1007,\n" | cmp -s - bbs.txt)
+     r=$?
+     rm -rf $dir
+     return $r
+}
+check cfgsplit
+
+# the run-length encoded block trace decodes to the text one
+blocktrace() {
+     dir=$(mktemp -d)
+     for i in $(seq 20); do cat tests/cfg.txt; done > $dir/trace.txt
+     (cd $dir && $OLDPWD/vmextract -c trace.txt > /dev/null &&
+      $OLDPWD/vmextract -t traceinfo.bin > decoded.txt && cmp -s decoded.txt traceinfo.txt)
+     r=$?
+     rm -rf $dir
+     return $r
+}
+check blocktrace
+
+# calls whose frame esp leaves before their first instruction, nested and at
+# the top level, enter no function
+calltree() {
+     dir=$(mktemp -d)
+     (cd $dir && $OLDPWD/vmextract -f $OLDPWD/tests/call.txt > /dev/null &&
+      echo "402000 2-4 incl 3 excl 3 loops 0" | cmp -s - calltree.txt)
+     r=$?
+     rm -rf $dir
+     return $r
+}
+check calltree
+
+# a view with no instructions is refused before any analysis
+noview() {
+     "$@" 2>&1 < /dev/null | grep -q "^No instructions in view"
+}
+check noview ./slicer -v 100-200 tests/partial1.txt
+check noview ./mgse -v 100-200 tests/partial1.txt
+check noview ./vmserver -v 100-200 tests/partial1.txt
+
+# an empty trace is refused before the CFG or handlers are built
+notrace() {
+     "$@" /dev/null 2>&1 < /dev/null | grep -q "^Empty trace!"
+}
+check notrace ./vmextract -c
+check notrace ./vmextract -d
+check notrace ./vmhunt
+
+exit $fail
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <set>
+#include <cstdlib>
+
+using namespace std;
+
+#include "../core.hpp"
+#include "../parser.hpp"
+#include "../mg-symengine.hpp"
+
+// Check symbolic execution of a slice against the whole trace. Both engines
+// start from the same register symbols, and the formulas of the checked
+// registers must agree on random concrete values of them.
+
+ADDR32 eval(Value *v, map<Value*, ADDR32> *inmap);
+
+static const string regname[8] = {"eax", "ebx", "ecx", "edx", "esi", "edi", "esp", "ebp"};
+
+int main(int argc, char **argv) {
+     if (argc < 4) {
+          fprintf(stderr, "usage: %s <tracefile> <sliceids> <reg>...\n", argv[0]);
+          return 1;
+     }
+
+     list<Inst> L;
+     ifstream infile(argv[1]);
+     if (!infile.is_open()) {
+          fprintf(stderr, "Open file error!\n");
+          return 1;
+     }
+     parseTrace(&infile, &L);
+     parseOperand(L.begin(), L.end());
+
+     vector<bool> slice;
+     ifstream idfile(argv[2]);
+     int id;
+     while (idfile >> id) {
+          if (id >= (int)slice.size())
+               slice.resize(id + 1, false);
+          slice[id] = true;
+     }
+
+     SEEngine *full = new SEEngine(), *sliced = new SEEngine();
+     full->initAllRegSymol(L.begin(), L.end());
+     sliced->initAllRegSymol(L.begin(), L.end());
+     Value *fullin[8], *slicedin[8];
+     for (int i = 0; i < 8; ++i) {
+          fullin[i] = full->getValue(regname[i]);
+          slicedin[i] = sliced->getValue(regname[i]);
+     }
+     sliced->setSlice(&slice);
+     full->symexec();
+     sliced->symexec();
+
+     int bad = 0;
+     srand(1);
+     for (int round = 0; round < 64; ++round) {
+          map<Value*, ADDR32> fullmap, slicedmap;
+          for (int i = 0; i < 8; ++i) {
+               ADDR32 v = ((ADDR32)rand() << 16) ^ rand();
+               fullmap[fullin[i]] = v;
+               slicedmap[slicedin[i]] = v;
+          }
+          for (int k = 3; k < argc; ++k) {
+               ADDR32 a = eval(full->getValue(argv[k]), &fullmap);
+               ADDR32 b = eval(sliced->getValue(argv[k]), &slicedmap);
+               if (a != b) {
+                    if (bad++ == 0)
+                         printf("%s: %s is %x in the trace but %x in the slice\n", argv[1], argv[k], a, b);
+               }
+          }
+     }
+
+     return bad != 0;
+}
@@ -7,11 +7,17 @@
 #include <stack>
 #include <vector>
 #include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <cstring>
+#include <unistd.h>
 
 using namespace std;
 
 #include "core.hpp"
 #include "parser.hpp"
+#include "extract.hpp"
 
 list<Inst> instlist;
 
@@ -19,10 +25,12 @@ list<Inst> instlist;
 struct FuncBody {
      int start;
      int end;
-     int length;                // end - start
+     int length;                // instructions from start to end, callees included
      unsigned int startAddr;
      unsigned int endAddr;
-     int loopn;
+     int loopn;                 // backward jumps in the function itself
+     int depth;                 // calls on the shadow stack, 0 for a top-level call
+     int self;                  // instructions in the function itself
 };
 
 struct Func {
@@ -31,18 +39,6 @@ struct Func {
 };
 
 
-// jmp instruction names in x86 assembly
-string jmpInstrName[33] = {"jo","jno","js","jns","je","jz","jne",
-                           "jnz","jb","jnae","jc","jnb","jae",
-                           "jnc","jbe","jna","ja","jnbe","jl",
-                           "jnge","jge","jnl","jle","jng","jg",
-                           "jnle","jp","jpe","jnp","jpo","jcxz",
-                           "jecxz", "jmp"};
-
-
-set<int> *jmpset;        // jmp instructions
-map<string, int> *instenum;     // instruction enumerations
-
 string getOpcName(int opc, map<string, int> *m)
 {
      for (map<string, int>::iterator it = m->begin(); it != m->end(); ++it) {
@@ -69,34 +65,72 @@ void printInstlist(list<Inst> *L, map<string, int> *m)
 }
 
 
-map<unsigned int, list<FuncBody *> *> *
-buildFuncList(list<Inst> *L)
+// Build the call tree of the trace with a shadow stack in one pass. A call
+// pushes a frame for the slot of its return address, esp - 4; the frame is
+// closed as soon as esp moves above that slot, whether by the matching ret or
+// by the unbalanced patterns VMs use, like popping the return address or
+// returning over several frames at once. A ret whose slot has no frame is a
+// jump and closes nothing. A call whose frame is closed before its first
+// instruction never entered a function and is dropped. The function
+// instances are returned in calls in the order of their start.
+void buildFuncList(list<Inst> *L, vector<FuncBody *> *calls)
 {
-     map<unsigned int, list<FuncBody *> *> *funcmap =
-          new map<unsigned int, list<FuncBody *> *>;
-     // list<Func> *funclist = new list<Func>;
-     stack<list<Inst>::iterator> stk;
-
+     struct Frame {
+          FuncBody *f;
+          ADDR32 slot;
+          int n;                // instructions before the function
+          int callee;           // instructions in its callees
+     };
+     vector<Frame> stk;
+     list<Inst>::iterator last = L->end();
+     FuncBody *pending = NULL;  // pushed by the last call, not entered yet
+     int n = 0;
+
+     // close the frame on top of the stack after the instruction last
+     auto close = [&]() {
+          Frame fr = stk.back();
+          fr.f->end = last->id;
+          fr.f->endAddr = last->addrn;
+          fr.f->length = n - fr.n;
+          fr.f->self = fr.f->length - fr.callee;
+          stk.pop_back();
+          if (!stk.empty()) stk.back().callee += fr.f->length;
+     };
 
-     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
-          // parse the whole instlist to build funclist
+     for (list<Inst>::iterator it = L->begin(); it != L->end(); last = it++, ++n) {
+          ADDR32 esp = it->ctxreg[6];
+          while (!stk.empty() && stk.back().slot < esp)
+               close();
+
+          if (pending != NULL) {
+               // the first instruction of a callee, wherever the call went,
+               // unless esp already left the frame of the call
+               if (!stk.empty() && stk.back().f == pending) {
+                    pending->start = it->id;
+                    pending->startAddr = it->addrn;
+                    calls->push_back(pending);
+               } else {
+                    delete pending;
+               }
+               pending = NULL;
+          } else if (!stk.empty() && last != L->end() && isjump(last->opc, jmpset) && it->addrn <= last->addrn) {
+               ++stk.back().f->loopn;
+          }
 
           if (it->opcstr == "call") {
-               stk.push(it);
-               // search whether the function is in the function list
-               // if yes, identify whether it is a new function instance
-               // if not, create a new function
-               map<unsigned int, list<FuncBody *> *>::iterator i = funcmap->find(it->addrn);
-               if (i == funcmap->end()) {
-                    unsigned int calladdr = stoul(it->oprs[0], nullptr, 16);
-                    funcmap->insert(pair<unsigned int, list<FuncBody *> *>(calladdr, NULL));
-               }
-          } else if (it->opcstr == "ret") {
-               if (!stk.empty()) stk.pop();
-          } else {}
+               pending = new FuncBody();
+               pending->depth = stk.size();
+               Frame fr = {pending, esp - 4, n + 1, 0};
+               stk.push_back(fr);
+          }
      }
-
-     return funcmap;
+     if (pending != NULL) {
+          // a call at the end of the trace never entered its function
+          stk.pop_back();
+          delete pending;
+     }
+     while (!stk.empty())
+          close();
 }
 
 void printFuncmap(map<unsigned int, list<FuncBody *> *> *funcmap)
@@ -107,33 +141,18 @@ void printFuncmap(map<unsigned int, list<FuncBody *> *> *funcmap)
      }
 }
 
-map<string, int> *buildOpcodeMap(list<Inst> *L)
+// Write the call tree to calltree.txt, one function instance per line in the
+// order of their start, indented by depth: entry address, id range, inclusive
+// and exclusive instruction counts and the number of backward jumps.
+void outputCallTree(vector<FuncBody *> *calls)
 {
-     map<string, int> *instenum = new map<string, int>;
-     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
-          if (instenum->find(it->opcstr) == instenum->end())
-               instenum->insert(pair<string, int>(it->opcstr, instenum->size()+1));
+     FILE *fp = fopen("calltree.txt", "w");
+     for (int i = 0, max = calls->size(); i < max; ++i) {
+          FuncBody *f = (*calls)[i];
+          fprintf(fp, "%*s%x %d-%d incl %d excl %d loops %d\n", 2 * f->depth, "",
+                  f->startAddr, f->start, f->end, f->length, f->self, f->loopn);
      }
-
-     return instenum;
-}
-
-int getOpc(string s, map<string, int> *m)
-{
-     map<string, int>::iterator it = m->find(s);
-     if (it != m->end())
-          return it->second;
-     else
-          return 0;
-}
-
-bool isjump(int i, set<int> *jumpset)
-{
-     set<int>::iterator it = jumpset->find(i);
-     if (it == jumpset->end())
-          return false;
-     else
-          return true;
+     fclose(fp);
 }
 
 
@@ -148,133 +167,6 @@ void countindjumps(list<Inst> *L) {
      cout << "number of indirect jumps: " << indjumpnum << endl;
 }
 
-void peephole(list<Inst> *L)
-{
-     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
-          if ((it->opcstr == "pushad" && next(it,1)->opcstr == "popad") ||
-              (it->opcstr == "popad" && next(it,1)->opcstr == "pushad") ||
-              (it->opcstr == "push" && next(it,1)->opcstr == "pop" && it->oprs[0] == next(it,1)->oprs[0]) ||
-              (it->opcstr == "pop" && next(it,1)->opcstr == "push" && it->oprs[0] == next(it,1)->oprs[0]) ||
-              (it->opcstr == "add" && next(it,1)->opcstr == "sub" && it->oprs[0] == next(it,1)->oprs[0] && it->oprs[1] == next(it,1)->oprs[1]) ||
-              (it->opcstr == "sub" && next(it,1)->opcstr == "add" && it->oprs[0] == next(it,1)->oprs[0] && it->oprs[1] == next(it,1)->oprs[1]) ||
-              (it->opcstr == "inc" && next(it,1)->opcstr == "dec" && it->oprs[0] == next(it,1)->oprs[0]) ||
-              (it->opcstr == "dec" && next(it,1)->opcstr == "inc" && it->oprs[0] == next(it,1)->oprs[0]) ) {
-               it = L->erase(it);
-               it = L->erase(it);
-               continue;
-          }
-     }
-}
-
-struct ctxswitch {
-     list<Inst>::iterator begin;
-     list<Inst>::iterator end;
-     ADDR32 sd;         // stack depth
-};
-
-list<ctxswitch> ctxsave;                  // context save instructions
-list<ctxswitch> ctxrestore;               // context restore instructions
-list<pair<ctxswitch, ctxswitch> > ctxswh;            // paired context switch instructions
-
-bool isreg(string s)
-{
-     if (s == "eax" || s == "ebx" || s == "ecx" || s == "edx" ||
-         s == "esi" || s == "edi" || s == "ebp") {
-          return true;
-     } else {
-          return false;
-     }
-}
-
-bool chkpush(list<Inst>::iterator i1, list<Inst>::iterator i2)
-{
-     int opcpush = getOpc("push", instenum);
-     for (list<Inst>::iterator it = i1; it != i2; ++it) {
-          if (it->opc != opcpush || !isreg(it->oprs[0]))
-               return false;
-     }
-     set<string> opcs;
-     for (list<Inst>::iterator it = i1; it != i2; ++it) {
-          if (opcs.find(it->oprs[0]) == opcs.end())
-               opcs.insert(it->oprs[0]);
-          else
-               return false;
-     }
-     return true;
-}
-
-bool chkpop(list<Inst>::iterator i1, list<Inst>::iterator i2)
-{
-     int opcpop = getOpc("pop", instenum);
-     for (list<Inst>::iterator it = i1; it != i2; ++it) {
-          if (it->opc != opcpop || !isreg(it->oprs[0]))
-               return false;
-     }
-     set<string> opcs;
-     for (list<Inst>::iterator it = i1; it != i2; ++it) {
-          if (opcs.find(it->oprs[0]) == opcs.end())
-               opcs.insert(it->oprs[0]);
-          else
-               return false;
-     }
-     return true;
-}
-
-
-// search the instruction list L and extract VM snippets
-void vmextract(list<Inst> *L)
-{
-     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
-          if (chkpush(it, next(it,7))) {
-               ctxswitch cs;
-               cs.begin = it;
-               cs.end   = next(it,7);
-               cs.sd    = next(it,7)->ctxreg[6];
-               ctxsave.push_back(cs);
-               cout << "push found" << endl;
-               cout << it->id << " " << it->addr << " " << it-> assembly << endl;
-          } else if (chkpop(it, next(it,7))) {
-               ctxswitch cs;
-               cs.begin = it;
-               cs.end   = next(it,7);
-               cs.sd    = it->ctxreg[6];
-               ctxrestore.push_back(cs);
-               cout << it->id << " " << it->addr << " " << it-> assembly << endl;
-          }
-     }
-
-     for (list<ctxswitch>::iterator i = ctxsave.begin(); i != ctxsave.end(); ++i) {
-          for (list<ctxswitch>::iterator ii = ctxrestore.begin(); ii != ctxrestore.end(); ++ii) {
-               if (i->sd == ii->sd) {
-                    ctxswh.push_back(pair<ctxswitch,ctxswitch>(*i, *ii));
-               }
-          }
-     }
-}
-
-void outputvm(list<pair<ctxswitch, ctxswitch> > *ctxswh)
-{
-     int n = 1;
-     for (list<pair<ctxswitch,ctxswitch> >::iterator i = ctxswh->begin(); i != ctxswh->end(); ++i) {
-          list<Inst>::iterator i1 = i->first.begin;
-          list<Inst>::iterator i2 = i->second.end;
-
-          string vmfile = "vm" + to_string(n++) + ".txt";
-          FILE *fp = fopen(vmfile.c_str(), "w");
-
-          for (list<Inst>::iterator ii = i1; ii != i2; ++ii) {
-               fprintf(fp, "%s;%s;", ii->addr.c_str(), ii->assembly.c_str());
-               for (int j = 0; j < 8; ++j) {
-                    fprintf(fp, "%x,", ii->ctxreg[j]);
-               }
-               fprintf(fp, "%x,%x\n", ii->raddr, ii->waddr);
-          }
-
-          fclose(fp);
-     }
-}
-
-
 bool ishex(string &s) {
      if (s.compare(0, 2, "0x") == 0)
           return true;
@@ -291,7 +183,7 @@ struct BB {
      ADDR32 endaddr;
      vector<int> out;
      int ty;                    // 1: end with jump
-                                // 2: no jump
+                                // 2: no jump, falls through to the next bb
 
      BB() {}
      BB(ADDR32 begin, ADDR32 end);
@@ -333,136 +225,154 @@ Edge::Edge(ADDR32 addr1, ADDR32 addr2, int type, int num)
      count = num;
 }
 
+// One VM handler: the target of the dispatcher and its dynamic instances,
+// each from the handler entry to the instruction before the next dispatch
+struct Handler {
+     ADDR32 entry;
+     int length;                // instructions in the first instance
+     int count;                 // number of instances
+     vector<pair<list<Inst>::iterator, list<Inst>::iterator> > inst;    // [first, last]
+};
+
 class CFG {
      vector<BB> bbs;
      vector<Edge> edges;
-     map<ADDR32, int> bbmap;
+     map<ADDR32, int> bbmap;                         // beginaddr -> bb, disjoint intervals
+     ShadowMap<int> *bbidx;                          // beginaddr -> bb + 1, once built
+     unordered_map<uint64_t, int> edgemap;           // (fromaddr, toaddr) -> edge
+
+     static uint64_t edgekey(ADDR32 from, ADDR32 to) {
+          return ((uint64_t)from << 32) | to;
+     }
+     int findBB(ADDR32 addr);
+     void splitBB(int bb, ADDR32 addr);
+     void addBB(ADDR32 begin, ADDR32 end, int type);
+     void coverBB(ADDR32 begin, ADDR32 end);
+     void addEdge(ADDR32 from, ADDR32 to, int type);
+     int beginBB(ADDR32 addr);
 
 public:
-     CFG() {}
+     CFG() : bbidx(NULL) {}
      CFG(list<Inst> *L);
+     ~CFG() { delete bbidx; }
+     CFG(const CFG &) = delete;
+     CFG &operator=(const CFG &) = delete;
      void checkConsist();
      void showCFG();
      void outputDot();
      void outputSimpleDot();
-     void showTrace(list<Inst> *L);
+     void blockTrace(list<Inst> *L, vector<int> *seq, vector<list<Inst>::iterator> *starts);
+     void showTrace(vector<int> &seq);
+     void foldTrace(list<Inst> *L, vector<int> &seq, vector<list<Inst>::iterator> &starts);
      void compressCFG();
+     ADDR32 findHandlers(list<Inst> *L, map<ADDR32, Handler> *H);
 };
 
+// the bb containing addr, or -1
+int CFG::findBB(ADDR32 addr)
+{
+     map<ADDR32, int>::iterator b = bbmap.upper_bound(addr);
+     if (b == bbmap.begin())
+          return -1;
+     --b;
+     return bbs[b->second].endaddr >= addr ? b->second : -1;
+}
+
+// split bb before addr; the first part keeps the index and falls through to
+// the second, which ends where bb ended
+void CFG::splitBB(int bb, ADDR32 addr)
+{
+     ADDR32 end = bbs[bb].endaddr;
+     int type = bbs[bb].ty;
+     bbs[bb].endaddr = addr - 1;
+     bbs[bb].ty = 2;
+     addBB(addr, end, type);
+}
+
+void CFG::addBB(ADDR32 begin, ADDR32 end, int type)
+{
+     bbmap.insert(pair<ADDR32, int>(begin, bbs.size()));
+     bbs.push_back(BB(begin, end, type));
+}
+
+// Make the addresses begin-end, run straight through by the trace, a chain
+// of bbs. A jump into the middle of a bb splits it, and the gaps between the
+// bbs already in the range become new bbs.
+void CFG::coverBB(ADDR32 begin, ADDR32 end)
+{
+     int bb = findBB(begin);
+     if (bb != -1 && bbs[bb].beginaddr < begin)
+          splitBB(bb, begin);
+
+     ADDR32 cur = begin;
+     while (true) {
+          map<ADDR32, int>::iterator b = bbmap.lower_bound(cur);
+          if (b == bbmap.end() || b->first > end) {
+               addBB(cur, end, 0);
+               return;
+          }
+          if (b->first > cur)
+               addBB(cur, b->first - 1, 2);
+          // a bb ending after end is only cut short by the end of the trace
+          if (bbs[b->second].endaddr >= end)
+               return;
+          cur = bbs[b->second].endaddr + 1;
+     }
+}
+
+// the bb beginning at addr, or -1, through the dense index built once the
+// bbs are final
+int CFG::beginBB(ADDR32 addr)
+{
+     Parameter p;
+     p.ty = Parameter::MEM;
+     p.idx = addr;
+     return bbidx->get(p) - 1;
+}
+
+void CFG::addEdge(ADDR32 from, ADDR32 to, int type)
+{
+     edgemap.insert(pair<uint64_t, int>(edgekey(from, to), edges.size()));
+     edges.push_back(Edge(from, to, type, 1));
+}
+
 // build CFG based on the trace L
 // use the addrn of the next instruction after a jump as the target address
 // the operand in the jump instruction are only used to decide whether it is
 // a direct or indirect jump
-CFG::CFG(list<Inst> *L)
+// blocks are kept as disjoint address intervals ordered by begin address, so
+// a run of the trace finds the blocks it overlaps in logarithmic time, and
+// edges are found by their address pair through a hash map
+CFG::CFG(list<Inst> *L) : bbidx(NULL)
 {
      list<Inst>::iterator it;
-     ADDR32 addr1, addr2;     // addr1 is start and addr2 is end
-     it = L->begin();
-     addr1 = it->addrn;
-     while (it != L->end()) {
-          if (isjump(it->opc, jmpset) || it->opcstr == "ret" || it->opcstr == "call") {
-               addr2 = it->addrn;
-
-               // build basic blocks
-               int curbb, max;
-               int res = 0;         // show the inquiry result of curbb
-                                    // 1: already exists
-                                    // 2 and 3: has overlap
-                                    // 4: newbb
-                                    // 0: others
-
-               for (curbb = 0, max = bbs.size(); curbb < max; ++curbb) {
-                    if (bbs[curbb].endaddr == addr2) break;
-               }
-
-               if (curbb != max) {
-                    if (bbs[curbb].beginaddr == addr1) {
-                         // the bb is already there
-                         res = 1;
-                    } else if (bbs[curbb].beginaddr < addr1) {
-                         // the bb is a subset, need to split
-                         res = 2;
-                    } else {
-                         // the bb is larger than the existing one
-                         res = 3;
-                    }
-               } else {
-                    // create a new bb
-                    res = 4;
-               }
-
-               BB *tempBB;
-               Edge *tempEdge;
-               switch (res) {
-               case 1:
-                    break;
-               case 2:
-                    bbs[curbb].endaddr = addr1 - 1;
-                    tempBB = new BB(addr1, addr2, 2);
-                    bbs.push_back(*tempBB);
-                    tempEdge = new Edge(bbs[curbb].endaddr, addr1, 2, 1);
-                    edges.push_back(*tempEdge);
-                    break;
-               case 3:          // still buggy, but can do now. Need more work.
-               {
-                    int i, max;
-                    for (i = 0, max = bbs.size(); i < max; ++i) {
-                         if (bbs[i].beginaddr == addr1) {
-                              break;
-                         }
-                    }
-                    if (i == max) {
-                         tempBB = new BB(addr1, bbs[curbb].beginaddr-1, 2);
-                         bbs.push_back(*tempBB);
-                    } else {
-                         // do nothing
-                    }
-
-                    for (i = 0, max = edges.size(); i < max; ++i) {
-                         if (edges[i].fromaddr == bbs[curbb].beginaddr-1 && edges[i].toaddr == bbs[curbb].beginaddr) {
-                              edges[i].count++;
-                              break;
-                         }
-                    }
-                    if (i == max) {
-                         tempEdge = new Edge(bbs[curbb].beginaddr-1, bbs[curbb].beginaddr, 2, 1);
-                         edges.push_back(*tempEdge);
-                    }
-                    break;
-               }
-               case 4:
-                    tempBB = new BB(addr1, addr2);
-                    bbs.push_back(*tempBB);
-                    break;
-               case 0:
-                    printf("others\n");
-                    printf("addr1: %x, addr2: %x\n", addr1, addr2);
-                    printf("curbb begin: %x, end %x\n", bbs[curbb].beginaddr, bbs[curbb].endaddr);
-                    break;
-               default:
-                    break;
-               }
-
-               addr1 = next(it, 1)->addrn;
-          } else {
-               // other instructions, read them into instvec
+     ADDR32 addr1 = L->begin()->addrn;     // start of the current run
+
+     // a run ends at a control transfer, or where the address goes back
+     // without one, as in code that runs out of traced instructions
+     for (it = L->begin(); it != L->end(); ++it) {
+          list<Inst>::iterator nit = next(it, 1);
+          if (isjump(it->opc, jmpset) || it->opcstr == "ret" || it->opcstr == "call" ||
+              nit == L->end() || nit->addrn < it->addrn) {
+               coverBB(addr1, it->addrn);
+               if (nit != L->end())
+                    addr1 = nit->addrn;
           }
-
-          ++it;
      }
 
-     // handle the last BB when the last instruction
-     // is not jump or ret
-     it = prev(L->end());
-     if (!(isjump(it->opc, jmpset) || it->opcstr == "ret" || it->opcstr == "call")) {
-          ADDR32 lastaddr = it->addrn;
-          BB *lastBB = new BB(addr1, lastaddr);
-          bbs.push_back(*lastBB);
+     // the bbs are final: index them by begin address, as a memory shadow
+     bbidx = new ShadowMap<int>();
+     Parameter p;
+     p.ty = Parameter::MEM;
+     for (int i = 0, max = bbs.size(); i < max; ++i) {
+          p.idx = bbs[i].beginaddr;
+          bbidx->ref(p) = i + 1;
      }
 
      // Add edges
      // Ignore the last instruction. If it is an jump/ret/call instruction, we don't
-     // know where the target is.
+     // know where the target is. Any other instruction running into the begin
+     // of a bb is a fall through edge.
      list<Inst>::iterator nit;
      for (it = L->begin(), nit = next(it, 1); nit != L->end(); ++it, nit = next(it, 1)) {
           ADDR32 curaddr, targetaddr;
@@ -485,21 +395,17 @@ CFG::CFG(list<Inst> *L)
                else
                     jumpty = 5; // is indirect call
 
+          } else if (beginBB(targetaddr) != -1) {
+               jumpty = 2;
           } else {
                continue;        // do nothing on other instructions
           }
 
-          int i, max;
-          for (i = 0, max = edges.size(); i < max; ++i) {
-               if (edges[i].fromaddr == curaddr && edges[i].toaddr == targetaddr) {
-                    edges[i].count++;
-                    break;
-               }
-          }
-
-          if (i == max) {       // not in current edges, add a new edge
-               Edge newedge(curaddr, targetaddr, jumpty, 1);
-               edges.push_back(newedge);
+          unordered_map<uint64_t, int>::iterator e = edgemap.find(edgekey(curaddr, targetaddr));
+          if (e != edgemap.end()) {
+               edges[e->second].count++;
+          } else {              // not in current edges, add a new edge
+               addEdge(curaddr, targetaddr, jumpty);
           }
      }
 
@@ -509,27 +415,19 @@ CFG::CFG(list<Inst> *L)
           addr1 = edges[i].fromaddr;
           addr2 = edges[i].toaddr;
 
-          int frombb, tobb, j, maxbbs;
-          for (j = 0, maxbbs = bbs.size(); j < maxbbs; ++j) {
-               if (bbs[j].endaddr == addr1) {
-                    frombb = j;
-                    break;
-               }
-          }
-          if (j == maxbbs)
-               printf("error: no endaddr == %x\n", addr1);
-          for (j = 0, maxbbs = bbs.size(); j < maxbbs; ++j) {
-               if (bbs[j].beginaddr == addr2) {
-                    tobb = j;
-                    break;
-               }
-          }
-          if (j == maxbbs)
+          int frombb, tobb;
+          frombb = findBB(addr1);
+          if (frombb == -1)
+               printf("error: no bb contains %x\n", addr1);
+          tobb = beginBB(addr2);
+          if (tobb == -1)
                printf("error: no beginaddr == %x\n", addr2);
 
           edges[i].from = frombb;
           edges[i].to = tobb;
-          int outmax;
+          if (frombb == -1 || tobb == -1)
+               continue;
+          int j, outmax;
           for (j = 0, outmax = bbs[frombb].out.size(); j < outmax; ++j) {
                if (bbs[frombb].out[j] == tobb) break;
           }
@@ -616,64 +514,60 @@ void CFG::outputSimpleDot()
 }
 
 
-// combine all BBs which only have one predecessor and one successor
+// find the representative of bb in a union-find forest, with path halving
+static int findrep(vector<int> &parent, int bb)
+{
+     while (parent[bb] != bb) {
+          parent[bb] = parent[parent[bb]];
+          bb = parent[bb];
+     }
+     return bb;
+}
+
+// combine all BBs which only have one predecessor and one successor.
+// An edge from a block with one successor to a block with one predecessor
+// is a chain edge; chain edges are merged with union-find, so the target
+// joins the chain of its source, in one pass over the edges.
 void CFG::compressCFG()
 {
-     struct BBinfo {
-          int id;
-          int nfrom;            // number of predecessor
-          int nto;              // nuber of successor
-
-          BBinfo(int a, int b, int c) {
-               id = a;
-               nfrom = b;
-               nto = c;
-          }
-     };
+     int bbnum = bbs.size();
+     vector<int> nfrom(bbnum, 0);     // number of predecessor
+     vector<int> nto(bbnum, 0);       // nuber of successor
+     vector<int> parent(bbnum);
 
-     list<BBinfo> bblist;
-     for (int i = 0, max = bbs.size(); i < max; ++i) {
-          BBinfo temp(i, 0, 0);
-          bblist.push_back(temp);
+     for (int i = 0; i < bbnum; ++i) {
+          parent[i] = i;
      }
      for (int i = 0, max = edges.size(); i < max; ++i) {
-          for (list<BBinfo>::iterator it = bblist.begin(); it != bblist.end(); ++it) {
-               if (it->id == edges[i].from) {
-                    it->nto++;
-               } else if (it->id == edges[i].to) {
-                    it->nfrom++;
-               } else {
-                    continue;
-               }
-          }
+          if (edges[i].from < 0 || edges[i].to < 0) continue;
+          nto[edges[i].from]++;
+          nfrom[edges[i].to]++;
      }
+
+     vector<Edge> kept;
      for (int i = 0, max = edges.size(); i < max; ++i) {
-          list<BBinfo>::iterator ifrom, ito;
-          for (list<BBinfo>::iterator it = bblist.begin(); it != bblist.end(); ++it) {
-               if (it->id == edges[i].from) ifrom = it;
-               if (it->id == edges[i].to) ito = it;
-          }
-          int bb1 = ifrom->id;
-          int bb2 = ito->id;
-          if (ifrom->nto == 1 && ito->nfrom == 1) {
-               edges.erase(edges.begin()+i);
-               for (int j = 0, maxj = edges.size(); j < maxj; ++j) {
-                    if (edges[j].from == bb2) edges[j].from = bb1;
-               }
-               ifrom->nto = ito->nto;
-               bblist.erase(ito);
+          int bb1 = edges[i].from;
+          int bb2 = edges[i].to;
+          if (bb1 < 0 || bb2 < 0) continue;
 
-               i = 0;
-               max = edges.size();
+          // a chain closing into a cycle keeps its last edge
+          if (nto[bb1] == 1 && nfrom[bb2] == 1 && findrep(parent, bb1) != bb2) {
+               parent[bb2] = bb1;
+          } else {
+               kept.push_back(edges[i]);
           }
      }
+     for (int i = 0, max = kept.size(); i < max; ++i) {
+          kept[i].from = findrep(parent, kept[i].from);
+          kept[i].to = findrep(parent, kept[i].to);
+     }
 
      FILE *fp = fopen("compcfg.dot", "w");
 
      fprintf(fp, "digraph G {\n");
-     for (int i = 0, max = edges.size(); i < max; ++i) {
+     for (int i = 0, max = kept.size(); i < max; ++i) {
           string lab;
-          switch (edges[i].ty) {
+          switch (kept[i].ty) {
           case 1:
                lab = "i";
                break;
@@ -690,10 +584,10 @@ void CFG::compressCFG()
                lab = "ic";
                break;
           default:
-               printf("unknown edge label: %d\n", edges[i].ty);
+               printf("unknown edge label: %d\n", kept[i].ty);
                break;
           }
-          fprintf(fp, "BB%d -> BB%d [label=\"%d,%s\"];\n", edges[i].from, edges[i].to, edges[i].count, lab.c_str());
+          fprintf(fp, "BB%d -> BB%d [label=\"%d,%s\"];\n", kept[i].from, kept[i].to, kept[i].count, lab.c_str());
      }
      fprintf(fp, "}\n");
 
@@ -735,54 +629,421 @@ void CFG::checkConsist()
      }
 }
 
-void CFG::showTrace(list<Inst> *L)
+// the block sequence of the trace L, and the instruction starting each block
+void CFG::blockTrace(list<Inst> *L, vector<int> *seq, vector<list<Inst>::iterator> *starts)
+{
+     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
+          int i = beginBB(it->addrn);
+          if (i != -1) {
+               seq->push_back(i);
+               starts->push_back(it);
+          }
+     }
+}
+
+// Write the block sequence of the trace to traceinfo.txt, and as a
+// compressed stream to traceinfo.bin: the magic "VMHBBT1\n", the number of
+// blocks, and records of varints <p> <r> <id>*p, the p ids repeated r times.
+// A record with r = 1 is a run of p blocks that do not repeat.
+void CFG::showTrace(vector<int> &seq)
 {
      FILE *fp = fopen("traceinfo.txt", "w");
+     for (int i = 0, max = seq.size(); i < max; ++i) {
+          fprintf(fp, "%d -> ", seq[i]);
+     }
+     fprintf(fp, "end\n");
+     fclose(fp);
 
-     for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
-          ADDR32 addr = it->addrn;
-          int i, max;
-          for (i = 0, max = bbs.size(); i < max; ++i) {
-               if (bbs[i].beginaddr == addr) break;
+     const int maxperiod = 64;
+     vector<uint8_t> buf;
+     putVarint(&buf, seq.size());
+     size_t lit = 0;          // start of the pending non-repeating run
+     for (size_t i = 0; i < seq.size(); ) {
+          int reps;
+          int period = findPeriod(seq, i, maxperiod, &reps);
+          if (period == 0) {
+               ++i;
+               continue;
           }
-          if (i != max) {
-               fprintf(fp, "%d -> ", i);
+          if (lit < i) {
+               putVarint(&buf, i - lit);
+               putVarint(&buf, 1);
+               for (size_t j = lit; j < i; ++j)
+                    putVarint(&buf, seq[j]);
           }
+          putVarint(&buf, period);
+          putVarint(&buf, reps);
+          for (size_t j = i; j < i + period; ++j)
+               putVarint(&buf, seq[j]);
+          i += (size_t)period * reps;
+          lit = i;
+     }
+     if (lit < seq.size()) {
+          putVarint(&buf, seq.size() - lit);
+          putVarint(&buf, 1);
+          for (size_t j = lit; j < seq.size(); ++j)
+               putVarint(&buf, seq[j]);
+     }
+
+     fp = fopen("traceinfo.bin", "wb");
+     fwrite("VMHBBT1\n", 1, 8, fp);
+     fwrite(buf.data(), 1, buf.size(), fp);
+     fclose(fp);
+}
+
+
+// Read a block sequence written by showTrace to traceinfo.bin and print it
+// to stdout in the format of traceinfo.txt.
+int dumpTraceInfo(string fname)
+{
+     ifstream infile(fname, ios::binary);
+     if (!infile.is_open()) {
+          fprintf(stderr, "Open file error!\n");
+          return 1;
+     }
+     vector<uint8_t> buf((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+     if (buf.size() < 8 || memcmp(buf.data(), "VMHBBT1\n", 8) != 0) {
+          fprintf(stderr, "%s is not a block trace!\n", fname.c_str());
+          return 1;
+     }
+     // a zero byte after the end stops a varint cut off by the end
+     size_t len = buf.size();
+     buf.push_back(0);
+     const uint8_t *p = buf.data() + 8, *end = buf.data() + len;
+
+     uint64_t total, period, reps, id;
+     vector<int> seq;
+     p = getVarint(p, &total);
+     while (p < end) {
+          p = getVarint(p, &period);
+          if (p >= end) break;
+          p = getVarint(p, &reps);
+          if (period == 0 || reps == 0 || period > (total - seq.size()) / reps) break;
+          size_t first = seq.size();
+          for (uint64_t j = 0; j < period && p < end; ++j) {
+               p = getVarint(p, &id);
+               seq.push_back(id);
+          }
+          if (seq.size() != first + period) break;
+          for (uint64_t r = 1; r < reps; ++r)
+               seq.insert(seq.end(), seq.begin() + first, seq.begin() + first + period);
+     }
+     if (p != end || seq.size() != total) {
+          fprintf(stderr, "%s is truncated or corrupt!\n", fname.c_str());
+          return 1;
+     }
+
+     for (int i = 0, max = seq.size(); i < max; ++i) {
+          printf("%d -> ", seq[i]);
+     }
+     printf("end\n");
+     return 0;
+}
+
+
+// Fold repeated block sequences of the trace, such as dispatcher loops, and
+// write the folded view to foldtrace.txt. Every distinct repeated sequence
+// gets a number and is listed once as "S<n>: <blocks>". The trace is then
+// one line per fold, "loop S<n> x<repeats> <first id>-<last id>" followed by
+// the change of each register per iteration, or * if it is not constant,
+// and "blocks <blocks> <first id>-<last id>" for a run that does not repeat.
+void CFG::foldTrace(list<Inst> *L, vector<int> &seq, vector<list<Inst>::iterator> &starts)
+{
+     static const char *regname[8] = {"eax", "ebx", "ecx", "edx", "esi", "edi", "esp", "ebp"};
+     const int maxperiod = 64;
+
+     map<vector<int>, int> seqid;
+     vector<string> folds;
+     char buf[64];
+     size_t lit = 0;
+     for (size_t i = 0; i <= seq.size(); ) {
+          int reps = 0;
+          int period = i < seq.size() ? findPeriod(seq, i, maxperiod, &reps) : 0;
+          if (period == 0 && i < seq.size()) {
+               ++i;
+               continue;
+          }
+
+          // the last instruction before block n
+          auto lastid = [&](size_t n) {
+               return n < starts.size() ? prev(starts[n])->id : prev(L->end())->id;
+          };
+
+          if (lit < i) {
+               string f = "blocks";
+               for (size_t j = lit; j < i; ++j)
+                    f += " " + to_string(seq[j]);
+               snprintf(buf, sizeof(buf), " %d-%d", starts[lit]->id, lastid(i));
+               folds.push_back(f + buf);
+          }
+          if (period == 0) break;
+
+          vector<int> body(seq.begin() + i, seq.begin() + i + period);
+          map<vector<int>, int>::iterator id = seqid.find(body);
+          if (id == seqid.end())
+               id = seqid.insert(make_pair(body, (int)seqid.size() + 1)).first;
+
+          size_t end = i + (size_t)period * reps;
+          snprintf(buf, sizeof(buf), "loop S%d x%d %d-%d", id->second, reps, starts[i]->id, lastid(end));
+          string f = buf;
+
+          // register deltas between the starts of consecutive iterations
+          for (int r = 0; r < 8; ++r) {
+               int ndelta = end < starts.size() ? reps : reps - 1;
+               bool same = true;
+               ADDR32 delta = starts[i + period]->ctxreg[r] - starts[i]->ctxreg[r];
+               for (int k = 1; k < ndelta && same; ++k) {
+                    ADDR32 d = starts[i + (k + 1) * period]->ctxreg[r] - starts[i + k * period]->ctxreg[r];
+                    same = (d == delta);
+               }
+               if (!same)
+                    snprintf(buf, sizeof(buf), " %s=*", regname[r]);
+               else if ((int32_t)delta < 0)
+                    snprintf(buf, sizeof(buf), " %s=-%x", regname[r], -delta);
+               else
+                    snprintf(buf, sizeof(buf), " %s=+%x", regname[r], delta);
+               f += buf;
+          }
+          folds.push_back(f);
+
+          i = end;
+          lit = i;
+     }
+
+     vector<const vector<int> *> byid(seqid.size());
+     for (map<vector<int>, int>::iterator i = seqid.begin(); i != seqid.end(); ++i) {
+          byid[i->second - 1] = &i->first;
      }
-     fprintf(fp, "end\n");
 
+     FILE *fp = fopen("foldtrace.txt", "w");
+     for (int i = 0, max = byid.size(); i < max; ++i) {
+          fprintf(fp, "S%d:", i + 1);
+          for (int j = 0, maxj = byid[i]->size(); j < maxj; ++j)
+               fprintf(fp, " %d", (*byid[i])[j]);
+          fprintf(fp, "\n");
+     }
+     fprintf(fp, "\n");
+     for (int i = 0, max = folds.size(); i < max; ++i) {
+          fprintf(fp, "%s\n", folds[i].c_str());
+     }
      fclose(fp);
 }
 
-void preprocess(list<Inst> *L)
+// Identify the VM dispatcher and its handlers. The dispatcher is the
+// indirect jump or ret with the most distinct targets in the CFG, and its
+// targets are the handler entries. A handler instance starts at an entry
+// reached from the dispatcher, and ends before the trace gets back to the
+// dispatcher block or leaves the VM, or at the dispatcher itself when each
+// handler does its own dispatch. Return the dispatcher address, or 0 if there is none.
+ADDR32 CFG::findHandlers(list<Inst> *L, map<ADDR32, Handler> *H)
 {
-     // build global instruction enum based on the instlist
-     instenum = buildOpcodeMap(L);
+     map<ADDR32, vector<int> > fanout;        // fromaddr -> ty 1 and 3 edges
+     for (int i = 0, max = edges.size(); i < max; ++i) {
+          if (edges[i].ty == 1 || edges[i].ty == 3)
+               fanout[edges[i].fromaddr].push_back(i);
+     }
+
+     ADDR32 disp = 0;
+     int best = 0, bestcount = 0;
+     for (map<ADDR32, vector<int> >::iterator i = fanout.begin(); i != fanout.end(); ++i) {
+          int n = i->second.size(), count = 0;
+          for (int j = 0; j < n; ++j)
+               count += edges[i->second[j]].count;
+          if (n > best || (n == best && count > bestcount)) {
+               disp = i->first;
+               best = n;
+               bestcount = count;
+          }
+     }
+     if (disp == 0)
+          return 0;
+
+     ADDR32 dispbegin = disp;
+     for (int j = 0; j < best; ++j) {
+          Edge &e = edges[fanout[disp][j]];
+          if (e.from >= 0)
+               dispbegin = bbs[e.from].beginaddr;
+          Handler h;
+          h.entry = e.toaddr;
+          h.length = 0;
+          h.count = 0;
+          H->insert(pair<ADDR32, Handler>(h.entry, h));
+     }
 
-     // update opc field in L
+     // a context restore leaves the VM
+     set<int> vmexit;
+     for (list<ctxswitch>::iterator i = ctxrestore.begin(); i != ctxrestore.end(); ++i) {
+          vmexit.insert(i->begin->id);
+     }
+
+     // walk the trace and cut it into handler instances
+     Handler *cur = NULL;
+     list<Inst>::iterator first;
+     int len = 0;
      for (list<Inst>::iterator it = L->begin(); it != L->end(); ++it) {
-          it->opc = getOpc(it->opcstr, instenum);
+          if (cur != NULL && ((it->addrn == dispbegin && it->addrn != disp) ||
+                              vmexit.find(it->id) != vmexit.end())) {
+               // back in the dispatcher block, or out of the VM
+               cur->inst.push_back(make_pair(first, prev(it)));
+               if (cur->count++ == 0) cur->length = len;
+               cur = NULL;
+          }
+          if (cur != NULL)
+               ++len;
+          if (it->addrn != disp || next(it) == L->end())
+               continue;
+
+          map<ADDR32, Handler>::iterator h = H->find(next(it)->addrn);
+          if (h == H->end())
+               continue;
+          if (cur != NULL) {
+               // the handler ends with its own dispatch
+               cur->inst.push_back(make_pair(first, it));
+               if (cur->count++ == 0) cur->length = len;
+          }
+          cur = &h->second;
+          first = next(it);
+          len = 0;
+     }
+     if (cur != NULL) {
+          cur->inst.push_back(make_pair(first, prev(L->end())));
+          if (cur->count++ == 0) cur->length = len;
      }
 
-     // create a set containing the opcodes of all jump instructions
-     jmpset = new set<int>;
-     for (string &s : jmpInstrName) {
-          int n;
-          if ((n = getOpc(s, instenum)) != 0) {
-               jmpset->insert(n);
+     return disp;
+}
+
+// write the handler table to handlers.txt: one line per handler with its
+// entry, length, instance count and the id ranges of its instances
+void outputHandlers(ADDR32 disp, map<ADDR32, Handler> *H)
+{
+     FILE *fp = fopen("handlers.txt", "w");
+
+     fprintf(fp, "dispatcher: %x, %d handlers\n", disp, (int)H->size());
+     for (map<ADDR32, Handler>::iterator i = H->begin(); i != H->end(); ++i) {
+          Handler &h = i->second;
+          fprintf(fp, "%x %d %d", h.entry, h.length, h.count);
+          for (int j = 0, max = h.inst.size(); j < max; ++j) {
+               fprintf(fp, " %d-%d", h.inst[j].first->id, h.inst[j].second->id);
           }
+          fprintf(fp, "\n");
      }
 
+     fclose(fp);
 }
 
 
+// Group the handler instances by their instruction sequence, looked up by
+// its hash; instances whose hashes collide are compared instruction by
+// instruction, so different sequences never share a group.
+// One representative instance of every group is written to handlerN.txt,
+// and the groups to handlergroups.txt: N, hash, handler entry, length,
+// multiplicity and the id range of the representative.
+void outputHandlerGroups(map<ADDR32, Handler> *H)
+{
+     struct Group {
+          ADDR32 entry;
+          int length;
+          int count;
+          list<Inst>::iterator first, last;
+     };
+     map<uint64_t, vector<int> > groupidx;          // hash -> groups, more on a collision
+     vector<uint64_t> hashes;
+     vector<Group> groups;
+
+     for (map<ADDR32, Handler>::iterator i = H->begin(); i != H->end(); ++i) {
+          Handler &h = i->second;
+          for (int j = 0, max = h.inst.size(); j < max; ++j) {
+               list<Inst>::iterator first = h.inst[j].first, last = h.inst[j].second;
+               uint64_t hash = hashInstSeq(first, next(last));
+               vector<int> &same = groupidx[hash];
+               int k, kmax;
+               for (k = 0, kmax = same.size(); k < kmax; ++k) {
+                    Group &g = groups[same[k]];
+                    if (sameInstSeq(g.first, next(g.last), first, next(last)))
+                         break;
+               }
+               if (k < kmax) {
+                    groups[same[k]].count++;
+                    continue;
+               }
+               Group ng;
+               ng.entry = h.entry;
+               ng.length = distance(first, next(last));
+               ng.count = 1;
+               ng.first = first;
+               ng.last = last;
+               same.push_back(groups.size());
+               hashes.push_back(hash);
+               groups.push_back(ng);
+          }
+     }
+
+     FILE *fp = fopen("handlergroups.txt", "w");
+     for (int i = 0, max = groups.size(); i < max; ++i) {
+          Group &g = groups[i];
+          fprintf(fp, "%d %016llx %x %d %d %d-%d\n", i + 1, (unsigned long long)hashes[i], g.entry,
+                  g.length, g.count, g.first->id, g.last->id);
+          outputTrace(g.first, next(g.last), "handler" + to_string(i + 1) + ".txt");
+     }
+     fclose(fp);
+}
+
+void usage(char *prog)
+{
+     fprintf(stderr, "usage: %s [-m] [-c] [-d] [-f] [-j nthread] [-p rulefile] <tracefile>\n", prog);
+     fprintf(stderr, "       %s -t traceinfo.bin\n", prog);
+}
+
 int main(int argc, char **argv) {
-     if (argc != 2) {
-          fprintf(stderr, "usage: %s <tracefile>\n", argv[0]);
+     bool docfg = false, dohandler = false, dofunc = false, materialize = false;
+     string tracebin;
+     int nthread = 1;
+     int opt;
+
+     while ((opt = getopt(argc, argv, "p:cdmfj:t:")) != -1) {
+          switch (opt) {
+          case 'c':
+               docfg = true;
+               break;
+          case 'd':
+               dohandler = true;
+               break;
+          case 'f':
+               dofunc = true;
+               break;
+          case 'j':
+               nthread = atoi(optarg);
+               break;
+          case 'm':
+               materialize = true;
+               break;
+          case 't':
+               tracebin = optarg;
+               break;
+          case 'p':
+               if (readCtxRules(optarg, &ctxrules) != 0)
+                    return 1;
+               break;
+          default:
+               usage(argv[0]);
+               return 1;
+          }
+     }
+     // a block trace is read on its own, without a trace
+     if (!tracebin.empty()) {
+          if (optind != argc) {
+               usage(argv[0]);
+               return 1;
+          }
+          return dumpTraceInfo(tracebin);
+     }
+     if (optind != argc - 1) {
+          usage(argv[0]);
           return 1;
      }
 
-     ifstream infile(argv[1]);
+     ifstream infile(argv[optind]);
      if (!infile.is_open()) {
           fprintf(stderr, "Open file error!\n");
           return 1;
@@ -792,13 +1053,53 @@ int main(int argc, char **argv) {
 
      infile.close();
 
+     if (instlist.empty()) {
+          fprintf(stderr, "Empty trace!\n");
+          return 1;
+     }
+
      preprocess(&instlist);
 
      peephole(&instlist);
 
-     vmextract(&instlist);
+     vmextract(&instlist, nthread);
 
-     outputvm(&ctxswh);
+     outputManifest(&ctxswh, argv[optind]);
+     if (materialize)
+          outputvm(&ctxswh);
+
+     if (dofunc) {
+          vector<FuncBody *> calls;
+          buildFuncList(&instlist, &calls);
+          outputCallTree(&calls);
+          for (int i = 0, max = calls.size(); i < max; ++i)
+               delete calls[i];
+     }
+
+     if (docfg || dohandler) {
+          CFG *cfg = new CFG(&instlist);
+          if (docfg) {
+               cfg->showCFG();
+               cfg->outputDot();
+               cfg->compressCFG();
+               vector<int> seq;
+               vector<list<Inst>::iterator> starts;
+               cfg->blockTrace(&instlist, &seq, &starts);
+               cfg->showTrace(seq);
+               cfg->foldTrace(&instlist, seq, starts);
+          }
+          if (dohandler) {
+               map<ADDR32, Handler> handlers;
+               ADDR32 disp = cfg->findHandlers(&instlist, &handlers);
+               if (disp == 0)
+                    fprintf(stderr, "No dispatcher found\n");
+               else {
+                    outputHandlers(disp, &handlers);
+                    outputHandlerGroups(&handlers);
+               }
+          }
+          delete cfg;
+     }
 
      return 0;
 }
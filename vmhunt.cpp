@@ -0,0 +1,129 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <set>
+#include <unistd.h>
+
+using namespace std;
+
+#include "core.hpp"
+#include "parser.hpp"
+#include "extract.hpp"
+#include "slice.hpp"
+#include "mg-symengine.hpp"
+
+// The whole VMHunt pipeline in one process. The trace is parsed once, VM
+// snippets are extracted, and each snippet is sliced in place on its range
+// of the instruction list and symbolically executed, without writing and
+// re-parsing intermediate files.
+
+list<Inst> instlist;
+
+set<string> seregs = {"eax", "ebx", "ecx", "edx", "esi", "edi", "esp", "ebp"};
+
+int main(int argc, char **argv) {
+     string reg = "eax";
+     bool dump = false;
+     int opt;
+
+     while ((opt = getopt(argc, argv, "r:dp:")) != -1) {
+          switch (opt) {
+          case 'r':
+               reg = optarg;
+               break;
+          case 'd':
+               dump = true;
+               break;
+          case 'p':
+               if (readCtxRules(optarg, &ctxrules) != 0)
+                    return 1;
+               break;
+          default:
+               fprintf(stderr, "usage: %s [-r reg] [-d] [-p rulefile] <tracefile>\n", argv[0]);
+               return 1;
+          }
+     }
+     if (optind != argc - 1 || seregs.find(reg) == seregs.end()) {
+          fprintf(stderr, "usage: %s [-r reg] [-d] [-p rulefile] <tracefile>\n", argv[0]);
+          return 1;
+     }
+
+     ifstream infile(argv[optind]);
+     if (!infile.is_open()) {
+          fprintf(stderr, "Open file error!\n");
+          return 1;
+     }
+
+     parseTrace(&infile, &instlist);
+     infile.close();
+
+     if (instlist.empty()) {
+          fprintf(stderr, "Empty trace!\n");
+          return 1;
+     }
+
+     preprocess(&instlist);
+     peephole(&instlist);
+     vmextract(&instlist);
+
+     parseOperand(instlist.begin(), instlist.end());
+     buildParameter(instlist);
+
+     vector<Parameter> loc;
+     parseLocation(reg, &loc);
+
+     // a snippet nested in another one is analysed as part of it
+     SnippetTree tree(&ctxswh);
+
+     // the engine runs on a snippet range and executes only its slice; the
+     // slice bitmap is shared by all snippets and cleared after each one
+     vector<bool> slice(prev(instlist.end())->id + 1, false);
+
+     int n = 1;
+     for (list<pair<ctxswitch,ctxswitch> >::iterator i = ctxswh.begin(); i != ctxswh.end(); ++i, ++n) {
+          list<Inst>::iterator begin = i->first.begin;
+          list<Inst>::iterator end = i->second.end;
+
+          int p = tree.nestedin(n, begin->id, prev(end)->id);
+          if (p != 0) {
+               cout << "vm" << n << ": nested in vm" << p << ", skipped" << endl;
+               continue;
+          }
+
+          vector<list<Inst>::iterator> sl;
+          sliceRange(begin, end, loc, &sl);
+
+          for (int j = 0, max = sl.size(); j < max; ++j) {
+               slice[sl[j]->id] = true;
+          }
+
+          cout << "vm" << n << ": " << begin->id << " - " << prev(end)->id;
+          cout << ", " << sl.size() << " instructions in slice of " << reg << endl;
+
+          SEEngine *se = new SEEngine();
+          se->initAllRegSymol(begin, end);
+          se->setSlice(&slice);
+          se->symexec();
+          se->dumpreg(reg);
+          delete se;
+          for (int j = 0, max = sl.size(); j < max; ++j) {
+               slice[sl[j]->id] = false;
+          }
+
+          if (dump) {
+               list<Inst> snippet(begin, end);
+               list<Inst> slist;
+               for (int j = 0, max = sl.size(); j < max; ++j) {
+                    slist.push_back(*sl[j]);
+               }
+               printTraceLLSE(snippet, "vm" + to_string(n) + ".txt");
+               printTraceLLSE(slist, "vm" + to_string(n) + ".slice.llse.trace");
+          }
+     }
+
+     return 0;
+}
@@ -0,0 +1,235 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unistd.h>
+
+using namespace std;
+
+// A quick profile of a trace, to see whether and where it is virtualized
+// before the expensive steps. The trace is streamed once and every line is
+// scanned in place, without building instructions.
+
+const uint64_t EMPTY = ~0ULL;
+
+// Open addressing table of counters with 64 bit keys, linear probing.
+class CountTable {
+     vector<uint64_t> keys;
+     vector<uint64_t> counts;
+     size_t n;
+
+     size_t slot(uint64_t key) const {
+          uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+          return (h >> 32) & (keys.size() - 1);
+     }
+     void grow() {
+          vector<uint64_t> k(keys.size() * 2, EMPTY), c(keys.size() * 2, 0);
+          keys.swap(k);
+          counts.swap(c);
+          n = 0;
+          for (size_t i = 0; i < k.size(); ++i) {
+               if (k[i] != EMPTY)
+                    ref(k[i]) = c[i];
+          }
+     }
+
+public:
+     CountTable() : keys(1024, EMPTY), counts(1024, 0), n(0) {}
+
+     uint64_t &ref(uint64_t key) {
+          size_t i = slot(key);
+          while (keys[i] != key) {
+               if (keys[i] == EMPTY) {
+                    if ((n + 1) * 2 > keys.size()) {
+                         grow();
+                         return ref(key);
+                    }
+                    keys[i] = key;
+                    ++n;
+                    break;
+               }
+               i = (i + 1) & (keys.size() - 1);
+          }
+          return counts[i];
+     }
+     size_t size() const { return n; }
+
+     // all entries, the largest counts first
+     vector<pair<uint64_t, uint64_t> > sorted() const {
+          vector<pair<uint64_t, uint64_t> > v;
+          v.reserve(n);
+          for (size_t i = 0; i < keys.size(); ++i) {
+               if (keys[i] != EMPTY)
+                    v.push_back(make_pair(counts[i], keys[i]));
+          }
+          sort(v.begin(), v.end(), [](const pair<uint64_t, uint64_t> &a, const pair<uint64_t, uint64_t> &b) {
+               return a.first > b.first || (a.first == b.first && a.second < b.second);
+          });
+          return v;
+     }
+};
+
+// FNV-1a of a mnemonic, the key of the opcode histogram
+uint64_t hashOpc(const char *s, size_t len)
+{
+     uint64_t h = 0xcbf29ce484222325ULL;
+     for (size_t i = 0; i < len; ++i) {
+          h ^= (uint8_t)s[i];
+          h *= 0x100000001b3ULL;
+     }
+     return h >> 1;               // never EMPTY
+}
+
+// an indirect branch: ret, or a jump or call not to an immediate address
+bool isIndirect(const char *opc, size_t len, const char *opr)
+{
+     if (len == 3 && strncmp(opc, "ret", 3) == 0)
+          return true;
+     if (opc[0] != 'j' && !(len == 4 && strncmp(opc, "call", 4) == 0))
+          return false;
+     return strncmp(opr, "0x", 2) != 0;
+}
+
+void usage(char *prog)
+{
+     fprintf(stderr, "usage: %s [-n top] <tracefile>\n", prog);
+}
+
+int main(int argc, char **argv) {
+     int top = 20;
+     int opt;
+
+     while ((opt = getopt(argc, argv, "n:")) != -1) {
+          switch (opt) {
+          case 'n':
+               top = atoi(optarg);
+               break;
+          default:
+               usage(argv[0]);
+               return 1;
+          }
+     }
+     if (optind != argc - 1) {
+          usage(argv[0]);
+          return 1;
+     }
+
+     FILE *fp = fopen(argv[optind], "r");
+     if (fp == NULL) {
+          fprintf(stderr, "Open file error!\n");
+          return 1;
+     }
+
+     CountTable addrs;             // address -> executions
+     CountTable opcs;              // mnemonic hash -> executions
+     CountTable branches;          // indirect branch site -> executions
+     CountTable targets;           // site << 32 | target -> executions
+     CountTable reads, writes;     // page -> accesses
+     unordered_map<uint64_t, string> opcname;
+     uint64_t ninst = 0, nread = 0, nwrite = 0;
+     uint64_t site = 0;
+     bool pending = false;         // the previous line is an indirect branch
+
+     char *line = NULL;
+     size_t cap = 0;
+     ssize_t len;
+     while ((len = getline(&line, &cap, fp)) != -1) {
+          char *p = line;
+          if (*p == '\n' || *p == '\0')
+               continue;
+          ++ninst;
+
+          // addr;opc oprs;eax,ebx,ecx,edx,esi,edi,esp,ebp,raddr,waddr,
+          uint64_t addr = strtoul(p, &p, 16);
+          if (*p++ != ';') {
+               fprintf(stderr, "Bad trace line %lu\n", (unsigned long)ninst);
+               continue;
+          }
+          ++addrs.ref(addr);
+          if (pending) {
+               ++targets.ref(site << 32 | addr);
+               pending = false;
+          }
+
+          char *opc = p;
+          size_t opclen = strcspn(opc, " ;");
+          uint64_t h = hashOpc(opc, opclen);
+          if (++opcs.ref(h) == 1)
+               opcname[h] = string(opc, opclen);
+          p = opc + opclen;
+          while (*p == ' ')
+               ++p;
+          if (isIndirect(opc, opclen, p)) {
+               ++branches.ref(addr);
+               site = addr;
+               pending = true;
+          }
+
+          // skip the operands and the eight registers
+          p = strchr(p, ';');
+          for (int i = 0; i < 8 && p != NULL; ++i)
+               p = strchr(p + 1, ',');
+          if (p == NULL)
+               continue;
+          uint64_t raddr = strtoul(p + 1, &p, 16);
+          uint64_t waddr = *p == ',' ? strtoul(p + 1, NULL, 16) : 0;
+          if (raddr != 0) {
+               ++reads.ref(raddr >> 12);
+               ++nread;
+          }
+          if (waddr != 0) {
+               ++writes.ref(waddr >> 12);
+               ++nwrite;
+          }
+     }
+     free(line);
+     fclose(fp);
+
+     printf("%lu instructions, %lu addresses, %lu opcodes, %lu reads, %lu writes\n",
+            (unsigned long)ninst, (unsigned long)addrs.size(), (unsigned long)opcs.size(),
+            (unsigned long)nread, (unsigned long)nwrite);
+
+     vector<pair<uint64_t, uint64_t> > v = addrs.sorted();
+     printf("\nhot addresses\n");
+     for (int i = 0, max = v.size(); i < max && i < top; ++i) {
+          printf("%8lx %10lu %6.2f%%\n", (unsigned long)v[i].second, (unsigned long)v[i].first,
+                 100.0 * v[i].first / ninst);
+     }
+
+     v = opcs.sorted();
+     printf("\nopcodes\n");
+     for (int i = 0, max = v.size(); i < max && i < top; ++i) {
+          printf("%-10s %10lu %6.2f%%\n", opcname[v[i].second].c_str(), (unsigned long)v[i].first,
+                 100.0 * v[i].first / ninst);
+     }
+
+     // distinct targets of each site; a dispatcher has many
+     CountTable fanout;
+     v = targets.sorted();
+     for (int i = 0, max = v.size(); i < max; ++i) {
+          ++fanout.ref(v[i].second >> 32);
+     }
+     v = fanout.sorted();
+     printf("\nindirect branches\n");
+     for (int i = 0, max = v.size(); i < max && i < top; ++i) {
+          printf("%8lx %6lu targets %10lu executions\n", (unsigned long)v[i].second,
+                 (unsigned long)v[i].first, (unsigned long)branches.ref(v[i].second));
+     }
+
+     v = reads.sorted();
+     printf("\nread pages\n");
+     for (int i = 0, max = v.size(); i < max && i < top; ++i) {
+          printf("%8lx %10lu\n", (unsigned long)v[i].second << 12, (unsigned long)v[i].first);
+     }
+     v = writes.sorted();
+     printf("\nwritten pages\n");
+     for (int i = 0, max = v.size(); i < max && i < top; ++i) {
+          printf("%8lx %10lu\n", (unsigned long)v[i].second << 12, (unsigned long)v[i].first);
+     }
+
+     return 0;
+}
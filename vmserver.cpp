@@ -0,0 +1,184 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <set>
+#include <climits>
+#include <unistd.h>
+
+using namespace std;
+
+#include "core.hpp"
+#include "parser.hpp"
+#include "slice.hpp"
+#include "mg-symengine.hpp"
+
+// A query server keeping one trace resident. The trace is parsed and its
+// parameters and dependence graph are built once, then commands are read
+// from stdin, one per line:
+//
+//   slice <id> [location]   backward slice of location right after
+//                           instruction id, or of the srcs of id
+//   range <id1> <id2>       set the instructions used by formula
+//   formula <reg>           symbolic formula of reg at the end of the range
+//   quit
+//
+// Every response starts with "ok" or "error" and ends with a line ".".
+
+list<Inst> instlist;
+vector<list<Inst>::iterator> instidx;   // instruction at each position
+DDGraph ddg;
+
+int rangeb, rangee;                     // current range, positions
+SEEngine *se = NULL;                    // SE result of the current range
+
+set<string> seregs = {"eax", "ebx", "ecx", "edx", "esi", "edi", "esp", "ebp"};
+
+bool getpos(int id, int *pos)
+{
+     if (id < ddg.firstid || (uint32_t)(id - ddg.firstid) >= ddg.ninst)
+          return false;
+     *pos = id - ddg.firstid;
+     return true;
+}
+
+void cmdslice(istringstream &args)
+{
+     int id, pos;
+     string locstr;
+
+     if (!(args >> id) || !getpos(id, &pos)) {
+          cout << "error: bad instruction id" << endl;
+          return;
+     }
+
+     vector<uint32_t> seeds;
+     if (args >> locstr) {
+          vector<Parameter> loc;
+          if (parseLocation(locstr, &loc) != 0) {
+               cout << "error: bad location " << locstr << endl;
+               return;
+          }
+          seeds = findWriters(instlist, instidx[pos], pos, loc);
+     } else {
+          seeds.push_back(pos * 2);
+     }
+
+     vector<uint32_t> sl = ddgslice(&ddg, seeds);
+     cout << "ok " << sl.size() << endl;
+     for (int i = 0, max = sl.size(); i < max; ++i) {
+          list<Inst>::iterator it = instidx[sl[i]];
+          cout << it->id << " " << it->addr << " " << it->assembly << endl;
+     }
+}
+
+void cmdrange(istringstream &args)
+{
+     int id1, id2, pos1, pos2;
+
+     if (!(args >> id1 >> id2) || !getpos(id1, &pos1) || !getpos(id2, &pos2) || pos1 > pos2) {
+          cout << "error: bad range" << endl;
+          return;
+     }
+     if (pos1 != rangeb || pos2 != rangee) {
+          rangeb = pos1;
+          rangee = pos2;
+          delete se;
+          se = NULL;
+     }
+     cout << "ok" << endl;
+}
+
+void cmdformula(istringstream &args)
+{
+     string reg;
+
+     if (!(args >> reg) || seregs.find(reg) == seregs.end()) {
+          cout << "error: bad register" << endl;
+          return;
+     }
+     if (se == NULL) {
+          se = new SEEngine();
+          se->initAllRegSymol(instidx[rangeb], next(instidx[rangee]));
+          se->symexec();
+     }
+     cout << "ok" << endl;
+     se->dumpreg(reg);
+}
+
+int main(int argc, char **argv) {
+     int first = 1, last = INT_MAX;
+     int opt;
+
+     while ((opt = getopt(argc, argv, "v:")) != -1) {
+          switch (opt) {
+          case 'v':
+               if (parseRange(optarg, &first, &last) != 0) {
+                    fprintf(stderr, "usage: %s [-v first-last] <tracefile>\n", argv[0]);
+                    return 1;
+               }
+               break;
+          default:
+               fprintf(stderr, "usage: %s [-v first-last] <tracefile>\n", argv[0]);
+               return 1;
+          }
+     }
+     if (optind != argc - 1) {
+          fprintf(stderr, "usage: %s [-v first-last] <tracefile>\n", argv[0]);
+          return 1;
+     }
+
+     ifstream infile(argv[optind]);
+     if (!infile.is_open()) {
+          fprintf(stderr, "Open file error!\n");
+          return 1;
+     }
+
+     parseTrace(&infile, &instlist, first, last);
+     infile.close();
+
+     if (instlist.empty()) {
+          if (last == INT_MAX)
+               fprintf(stderr, "Empty trace!\n");
+          else
+               fprintf(stderr, "No instructions in view %d-%d!\n", first, last);
+          return 1;
+     }
+
+     parseOperand(instlist.begin(), instlist.end());
+     buildParameter(instlist);
+     buildDDG(instlist, &ddg);
+
+     for (list<Inst>::iterator it = instlist.begin(); it != instlist.end(); ++it) {
+          instidx.push_back(it);
+     }
+     rangeb = 0;
+     rangee = instidx.size() - 1;
+
+     cout << "ready " << instidx.size() << " instructions" << endl << "." << endl;
+
+     string line;
+     while (getline(cin, line)) {
+          istringstream args(line);
+          string cmd;
+          if (!(args >> cmd)) continue;
+
+          if (cmd == "slice") {
+               cmdslice(args);
+          } else if (cmd == "range") {
+               cmdrange(args);
+          } else if (cmd == "formula") {
+               cmdformula(args);
+          } else if (cmd == "quit") {
+               break;
+          } else {
+               cout << "error: unknown command " << cmd << endl;
+          }
+          cout << "." << endl;
+     }
+
+     return 0;
+}